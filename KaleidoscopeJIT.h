@@ -18,6 +18,7 @@
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
 #include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
@@ -26,11 +27,15 @@
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Mangler.h"
 #include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Host.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
+#include "jit_memory.h"
+#include "jit_symbol_table.h"
 #include <algorithm>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -45,37 +50,130 @@ public:
   KaleidoscopeJIT()
       : Resolver(createLegacyLookupResolver(
             ES,
-            [this](const std::string &Name) { return findMangledSymbol(Name); },
+            [this](const std::string &Name) { return resolveSymbol(Name); },
             [](Error Err) { cantFail(std::move(Err), "lookupFlags failed"); })),
-        TM(EngineBuilder().selectTarget()), DL(TM->createDataLayout()),
+        TM(EngineBuilder().setMCPU(sys::getHostCPUName()).selectTarget()),
+        FastTM(EngineBuilder()
+                   .setMCPU(sys::getHostCPUName())
+                   .setOptLevel(CodeGenOpt::None)
+                   .selectTarget()),
+        DL(TM->createDataLayout()),
         ObjectLayer(AcknowledgeORCv1Deprecation, ES,
                     [this](VModuleKey) {
+                      // Every module gets its own memory manager so that
+                      // removeModule can free it, the pages come from Mapper.
                       return ObjLayerT::Resources{
-                          std::make_shared<SectionMemoryManager>(), Resolver};
+                          std::make_shared<SectionMemoryManager>(&Mapper),
+                          Resolver};
                     }),
         CompileLayer(AcknowledgeORCv1Deprecation, ObjectLayer,
-                     SimpleCompiler(*TM)) {
+                     SimpleCompiler(*TM)),
+        FastCompileLayer(AcknowledgeORCv1Deprecation, ObjectLayer,
+                         SimpleCompiler(*FastTM)),
+        Stubs(createLocalIndirectStubsManagerBuilder(TM->getTargetTriple())()) {
+    FastTM->setFastISel(true);
     llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
   }
 
+  // Keeps the code of removed modules alive while calling into it from
+  // other threads, see JitSymbolTable.
+  using ReadGuard = JitSymbolTable::ReadGuard;
+
   TargetMachine &getTargetMachine() { return *TM; }
 
-  VModuleKey addModule(std::unique_ptr<Module> M) {
+  JitSymbolTable &getSymbolTable() { return Symbols; }
+
+  // addModule and removeModule can be called from any thread, while other
+  // threads look up symbols and run code. Fast compiles at -O0 with
+  // FastISel, for code that has to be ready soon rather than be fast.
+  VModuleKey addModule(std::unique_ptr<Module> M, bool Fast = false) {
+    std::lock_guard<std::mutex> Lock(WriteMutex);
+
+    std::vector<std::string> Names;
+    for (auto &GV : M->global_values())
+      if (!GV.isDeclaration() && !GV.hasLocalLinkage())
+        Names.push_back(mangle(GV.getName().str()));
+
     auto K = ES.allocateVModule();
-    cantFail(CompileLayer.addModule(K, std::move(M)));
+    auto &Layer = Fast ? FastCompileLayer : CompileLayer;
+    cantFail(Layer.addModule(K, std::move(M)));
     ModuleKeys.push_back(K);
+
+    // Link and finalize right away, readers only ever see finished code.
+    auto &Defs = ModuleSymbols[K];
+    for (auto &Name : Names)
+      if (auto Sym = CompileLayer.findSymbolIn(K, Name, ExportedSymbolsOnly))
+        Defs.push_back({Name, cantFail(Sym.getAddress())});
+
+    publishSymbols();
+    Symbols.Reclaim();
     return K;
   }
 
+  // The module is freed once no ReadGuard taken before is left.
   void removeModule(VModuleKey K) {
+    std::lock_guard<std::mutex> Lock(WriteMutex);
     ModuleKeys.erase(find(ModuleKeys, K));
-    cantFail(CompileLayer.removeModule(K));
+    ModuleSymbols.erase(K);
+    publishSymbols();
+    Symbols.Retire([this, K]() { cantFail(CompileLayer.removeModule(K)); });
+    Symbols.Reclaim();
   }
 
   JITSymbol findSymbol(const std::string Name) {
     return findMangledSymbol(mangle(Name));
   }
 
+  // Make Name an indirection stub that jumps to Target, if it is none yet.
+  // Calls to Name from JIT code resolve to the stub, so updateStub
+  // retargets all of them. Without Publish a new stub is only seen by the
+  // modules added next, not by findSymbol, until publishStub.
+  JITTargetAddress createStub(const std::string &Name, JITTargetAddress Target,
+                              bool Publish = true) {
+    std::lock_guard<std::mutex> Lock(WriteMutex);
+    auto MangledName = mangle(Name);
+    if (auto Stub = Stubs->findStub(MangledName, false)) {
+      auto Addr = Stub.getAddress();
+      // an unpublished stub removed before is created again
+      if (!StubSymbols.count(MangledName) && !PendingStubs.count(MangledName)) {
+        cantFail(Stubs->updatePointer(MangledName, Target));
+        addStubSymbol(MangledName, Addr, Publish);
+      }
+      return Addr;
+    }
+
+    cantFail(
+        Stubs->createStub(MangledName, Target, JITSymbolFlags::Exported));
+    auto Addr = Stubs->findStub(MangledName, false).getAddress();
+    addStubSymbol(MangledName, Addr, Publish);
+    return Addr;
+  }
+
+  // Make a stub created without Publish visible to findSymbol.
+  void publishStub(const std::string &Name) {
+    std::lock_guard<std::mutex> Lock(WriteMutex);
+    auto It = PendingStubs.find(mangle(Name));
+    if (It == PendingStubs.end())
+      return;
+    StubSymbols.insert(*It);
+    PendingStubs.erase(It);
+    publishSymbols();
+    Symbols.Reclaim();
+  }
+
+  // Drop a stub that was never published. The stubs manager cannot free
+  // it, a later createStub of Name takes it up again.
+  void removeStub(const std::string &Name) {
+    std::lock_guard<std::mutex> Lock(WriteMutex);
+    PendingStubs.erase(mangle(Name));
+  }
+
+  // Swap the target of a stub. A single pointer store, threads running
+  // through the stub at the same time take either the old or the new one.
+  void updateStub(const std::string &Name, JITTargetAddress Target) {
+    cantFail(Stubs->updatePointer(mangle(Name), Target));
+  }
+
 private:
   std::string mangle(const std::string &Name) {
     std::string MangledName;
@@ -86,26 +184,45 @@ private:
     return MangledName;
   }
 
-  JITSymbol findMangledSymbol(const std::string &Name) {
-#ifdef _WIN32
-    // The symbol lookup of ObjectLinkingLayer uses the SymbolRef::SF_Exported
-    // flag to decide whether a symbol will be visible or not, when we call
-    // IRCompileLayer::findSymbolIn with ExportedSymbolsOnly set to true.
-    //
-    // But for Windows COFF objects, this flag is currently never set.
-    // For a potential solution see: https://reviews.llvm.org/rL258665
-    // For now, we allow non-exported symbols on Windows as a workaround.
-    const bool ExportedSymbolsOnly = false;
-#else
-    const bool ExportedSymbolsOnly = true;
-#endif
+  // Rebuild the symbol table from the modules in the order they were added.
+  // A later definition replaces an earlier one: the opposite of the usual
+  // search order for dlsym, but makes more sense in a REPL where we want to
+  // bind to the newest available definition.
+  void publishSymbols() {
+    auto Table = std::make_unique<JitSymbolTable::SymbolMap>();
+    for (auto K : ModuleKeys)
+      for (auto &Def : ModuleSymbols[K])
+        (*Table)[Def.first] = Def.second;
+    // a stub stands for every definition of its name
+    for (auto &Stub : StubSymbols)
+      (*Table)[Stub.first] = Stub.second;
+    Symbols.Publish(std::move(Table));
+  }
+
+  void addStubSymbol(const std::string &MangledName, JITTargetAddress Addr,
+                     bool Publish) {
+    if (!Publish) {
+      PendingStubs[MangledName] = Addr;
+      return;
+    }
+    StubSymbols[MangledName] = Addr;
+    publishSymbols();
+    Symbols.Reclaim();
+  }
 
-    // Search modules in reverse order: from last added to first added.
-    // This is the opposite of the usual search order for dlsym, but makes more
-    // sense in a REPL where we want to bind to the newest available definition.
-    for (auto H : make_range(ModuleKeys.rbegin(), ModuleKeys.rend()))
-      if (auto Sym = CompileLayer.findSymbolIn(H, Name, ExportedSymbolsOnly))
-        return Sym;
+  // The linker looks up the symbols of a module in addModule, under
+  // WriteMutex, so it may see the unpublished stubs.
+  JITSymbol resolveSymbol(const std::string &Name) {
+    auto It = PendingStubs.find(Name);
+    if (It != PendingStubs.end())
+      return JITSymbol(It->second, JITSymbolFlags::Exported);
+    return findMangledSymbol(Name);
+  }
+
+  JITSymbol findMangledSymbol(const std::string &Name) {
+    // Lock free, see JitSymbolTable.
+    if (auto SymAddr = Symbols.Lookup(Name))
+      return JITSymbol(SymAddr, JITSymbolFlags::Exported);
 
     // If we can't find the symbol in the JIT, try looking in the host process.
     if (auto SymAddr = RTDyldMemoryManager::getSymbolAddressInProcess(Name))
@@ -127,10 +244,39 @@ private:
   ExecutionSession ES;
   std::shared_ptr<SymbolResolver> Resolver;
   std::unique_ptr<TargetMachine> TM;
+  std::unique_ptr<TargetMachine> FastTM;
   const DataLayout DL;
+  ArenaMemoryMapper Mapper;
   ObjLayerT ObjectLayer;
+  // Both compile into ObjectLayer, either one finds and removes the modules
+  // added through the other.
   CompileLayerT CompileLayer;
+  CompileLayerT FastCompileLayer;
+  std::unique_ptr<IndirectStubsManager> Stubs;
+  std::map<std::string, JITTargetAddress> StubSymbols;
+  // created without Publish, see createStub
+  std::map<std::string, JITTargetAddress> PendingStubs;
   std::vector<VModuleKey> ModuleKeys;
+  std::map<VModuleKey, std::vector<std::pair<std::string, JITTargetAddress>>>
+      ModuleSymbols;
+  // Declared after CompileLayer, reclaiming the last removed modules on
+  // destruction still needs it.
+  JitSymbolTable Symbols;
+  // Serializes addModule and removeModule.
+  std::mutex WriteMutex;
+
+#ifdef _WIN32
+  // The symbol lookup of ObjectLinkingLayer uses the SymbolRef::SF_Exported
+  // flag to decide whether a symbol will be visible or not, when we call
+  // IRCompileLayer::findSymbolIn with ExportedSymbolsOnly set to true.
+  //
+  // But for Windows COFF objects, this flag is currently never set.
+  // For a potential solution see: https://reviews.llvm.org/rL258665
+  // For now, we allow non-exported symbols on Windows as a workaround.
+  static constexpr bool ExportedSymbolsOnly = false;
+#else
+  static constexpr bool ExportedSymbolsOnly = true;
+#endif
 };
 
 } // end namespace orc
@@ -1,343 +1,246 @@
 #include "abstract_syntax_tree.h"
-#include "tools.h"
-#include <vector>
-#include <iostream>
 
-llvm::LLVMContext kTheContext;
-llvm::IRBuilder<> kBuilder(kTheContext);
-std::unique_ptr<llvm::Module> kTheModule;
-//std::map<std::string, llvm::Value *> kNamedValues;
-std::map<std::string, llvm::AllocaInst *> kNamedValues;
-std::unique_ptr<llvm::legacy::FunctionPassManager> kTheFpm;
-std::unique_ptr<llvm::orc::KaleidoscopeJIT> kTheJit;
-std::map<std::string, std::unique_ptr<PrototypeAst>> kFunctionProtos;
+using namespace std;
 
-
-using namespace llvm;
-
-Value *NumberExprAst::CodeGen() {
-    return ConstantFP::get(kTheContext, APFloat(val_));
-}
-
-Value *VariableExprAst::CodeGen() {
-    Value *V = kNamedValues[name_];
-
-    if (!V) {
-        std::cerr << "name " << name_ << std::endl;
-        LogErrorV("Unknown variable name");
+NameId Ast::Intern(llvm::StringRef name) {
+    auto inserted = name_ids_.insert(make_pair(name, NameId(name_offsets_.size() - 1)));
+    if (inserted.second) {
+        name_chars_ += name;
+        name_offsets_.push_back(name_chars_.size());
     }
-
-    return kBuilder.CreateLoad(V, name_.c_str());
+    return inserted.first->second;
 }
 
-Value *BinaryExprAst::CodeGen() {
-    // Special case for '=' because the LHS is a variable
-    // rather than an expression.
-    if (op_ == '=') {
-        VariableExprAst *lhse = dynamic_cast<VariableExprAst*>(lhs_.get());
-        if (!lhse)
-            return LogErrorV("destination of '=' must be a variable");
-
-        Value *val = rhs_->CodeGen();
-        if (!val)
-            return nullptr;
-
-        // look up the name
-        Value *v = kNamedValues[lhse->name()];
-        if (!v)
-            return LogErrorV("Unknown variable name");
-
-        kBuilder.CreateStore(val, v);
-        return val;
-    }
-    
-    Value *l = lhs_->CodeGen();
-    Value *r = rhs_->CodeGen();
-    if (!l || !r)
-        return nullptr;
-
-    switch (op_) {
-    case '+':
-        return kBuilder.CreateFAdd(l, r, "addtmp");
-    case '-':
-        return kBuilder.CreateFSub(l, r, "subtmp");
-    case '*':
-        return kBuilder.CreateFMul(l, r, "multmp");
-    case '<':
-        l = kBuilder.CreateFCmpULT(l, r, "cmptmp");
-        return kBuilder.CreateUIToFP(l, Type::getDoubleTy(kTheContext), "booltmp");
-    default:
-        return LogErrorV("invalid binary operator");
-    }
+NodeId Ast::AddNode(NodeKind kind, uint32_t offset, uint32_t a, uint32_t b, uint32_t c) {
+    AstNode node;
+    node.kind = kind;
+    node.op = 0;
+    node.flags = 0;
+    node.offset = offset;
+    node.a = a;
+    node.b = b;
+    node.c = c;
+    nodes_.push_back(node);
+    return nodes_.size() - 1;
 }
 
-Value *CallExprAst::CodeGen() {
-    Function *callee_f = GetFunction(callee_);
-    if (!callee_f)
-        return LogErrorV("Unknown function referenced");
-
-    if (callee_f->arg_size() != args_.size())
-        return LogErrorV("Incorrect # arguments passed");
-
-    std::vector<Value *> args_v;
-    for (unsigned i = 0, e = args_.size(); i != e; ++i) {
-        args_v.push_back(args_[i]->CodeGen());
-        if (!args_v.back())
-            return nullptr;
-    }
-
-    return kBuilder.CreateCall(callee_f, args_v, "calltmp");
+ListId Ast::AddList(llvm::ArrayRef<uint32_t> items) {
+    ListId id = extra_.size();
+    extra_.push_back(items.size());
+    extra_.insert(extra_.end(), items.begin(), items.end());
+    return id;
 }
 
-Value *StatListAst::CodeGen() {
-    for (auto &stat : stat_list_)
-        if (!stat->CodeGen())
-            return nullptr;
-
-    std::cerr << "StatListAst codegen success" << std::endl;
-    return Constant::getNullValue(Type::getDoubleTy(kTheContext));
+NodeId Ast::AddNumber(uint32_t offset, double val) {
+    numbers_.push_back(val);
+    return AddNode(kNodeNumber, offset, numbers_.size() - 1);
 }
 
-Value *IfStatAst::CodeGen() {
-    Value *cond_v = cond_->CodeGen();
-    if (!cond_v)
-        return nullptr;
-
-    // Convert condition to a bool by comparing non-equal to 0.0.
-    cond_v = kBuilder.CreateFCmpONE(cond_v, ConstantFP::get(kTheContext, APFloat(0.0)), "ifcond");
-
-    Function *the_function = kBuilder.GetInsertBlock()->getParent();
-    
-    // Create blocks for the then and else cases.  Insert the 'then' block at the
-    // end of the function.
-    BasicBlock *then_bb = BasicBlock::Create(kTheContext, "then", the_function);
-    BasicBlock *else_bb = BasicBlock::Create(kTheContext, "else");
-    BasicBlock *merge_bb = BasicBlock::Create(kTheContext, "ifcont");
-
-    kBuilder.CreateCondBr(cond_v, then_bb, else_bb);
-
-    // Emit then value.
-    kBuilder.SetInsertPoint(then_bb);
-
-    //Value *then_v = then_->CodeGen();
-    //if (!then_v)
-        //return nullptr;
-    if (!then_->CodeGen())
-        return nullptr;
-
-    kBuilder.CreateBr(merge_bb);
-
-    // Codegen of 'Then' can change the current block, update ThenBB for the PHI.
-    then_bb = kBuilder.GetInsertBlock();
-
-    // Emit else value.
-    the_function->getBasicBlockList().push_back(else_bb);
-    kBuilder.SetInsertPoint(else_bb);
-
-    //Value *else_v = else_->CodeGen();
-    //if (!else_v)
-        //return nullptr;
-    if (!else_->CodeGen())
-        return nullptr;
-
-    kBuilder.CreateBr(merge_bb);
-    // codegen of 'Else' can change the current block, update ElseBB for the PHI.
-    else_bb = kBuilder.GetInsertBlock();
-
-    // emit merge block.
-    the_function->getBasicBlockList().push_back(merge_bb);
-    kBuilder.SetInsertPoint(merge_bb);
-    // nop
-    kBuilder.CreateFAdd(
-            ConstantFP::get(kTheContext, APFloat(0.0)),
-            ConstantFP::get(kTheContext, APFloat(0.0)),
-            "nop");
-    return Constant::getNullValue(Type::getDoubleTy(kTheContext));
+NodeId Ast::AddVariable(uint32_t offset, NameId name) {
+    return AddNode(kNodeVariable, offset, name);
 }
 
-Value *WhileStatAst::CodeGen() {
-    std::cerr << "start codegen while" << std::endl;
-    //Value *cond_v = cond_->CodeGen();
-    //if (!cond_v)
-        //return nullptr;
-
-    // Convert condition to a bool by comparing non-equal to 0.0.
-    //cond_v = kBuilder.CreateFCmpONE(cond_v, ConstantFP::get(kTheContext, APFloat(0.0)), "whilecond");
-
-    Function *the_function = kBuilder.GetInsertBlock()->getParent();
-    
-    // Create blocks for the then and else cases.  Insert the 'then' block at the
-    // end of the function.
-    BasicBlock *check_bb = BasicBlock::Create(kTheContext, "check", the_function);
-    BasicBlock *loop_bb = BasicBlock::Create(kTheContext, "loop");
-    BasicBlock *after_bb = BasicBlock::Create(kTheContext, "afterloop");
-
-    //kBuilder.CreateCondBr(cond_v, loop_bb, after_bb);
-    kBuilder.CreateBr(check_bb);
-    
-    // Emit then value.
-    kBuilder.SetInsertPoint(check_bb);
-
-    Value *cond_v = cond_->CodeGen();
-    if (!cond_v)
-        return nullptr;
-    
-    cond_v = kBuilder.CreateFCmpONE(cond_v, ConstantFP::get(kTheContext, APFloat(0.0)), "whilecond");
-    kBuilder.CreateCondBr(cond_v, loop_bb, after_bb);
-
-    the_function->getBasicBlockList().push_back(loop_bb);
-    kBuilder.SetInsertPoint(loop_bb);
-    if (!body_->CodeGen())
-        return nullptr;
-
-    kBuilder.CreateBr(check_bb);
-
-    // Emit else value.
-    the_function->getBasicBlockList().push_back(after_bb);
-    kBuilder.SetInsertPoint(after_bb);
-
-    // nop
-    kBuilder.CreateFAdd(
-            ConstantFP::get(kTheContext, APFloat(0.0)),
-            ConstantFP::get(kTheContext, APFloat(0.0)),
-            "nop");
-
-    return Constant::getNullValue(Type::getDoubleTy(kTheContext));
+NodeId Ast::AddUnary(uint32_t offset, uint8_t op, NodeId operand) {
+    NodeId id = AddNode(kNodeUnary, offset, operand);
+    nodes_[id].op = op;
+    return id;
 }
 
-Value *ReturnStatAst::CodeGen() {
-    Value *retval = expr_->CodeGen();
-    if (!retval)
-        return nullptr;
-    
-    kBuilder.CreateRet(retval);
-
-    std::cerr << "Return codegen success" << std::endl;
-    return Constant::getNullValue(Type::getDoubleTy(kTheContext));
-} 
-
-Value *AssignmentStatAst::CodeGen() {
-    
-    Value *val = expr_->CodeGen();
-
-    kBuilder.CreateStore(val, kNamedValues[name_]);
-
-    return Constant::getNullValue(Type::getDoubleTy(kTheContext));
+NodeId Ast::AddBinary(uint32_t offset, uint8_t op, NodeId lhs, NodeId rhs) {
+    NodeId id = AddNode(kNodeBinary, offset, lhs, rhs);
+    nodes_[id].op = op;
+    return id;
 }
 
-Value *CompoundStatAst::CodeGen() {
-    std::vector<AllocaInst *> old_bindings;
+NodeId Ast::AddCall(uint32_t offset, NameId callee, llvm::ArrayRef<NodeId> args) {
+    return AddNode(kNodeCall, offset, callee, AddList(args));
+}
 
-    Function *the_function = kBuilder.GetInsertBlock()->getParent();
+NodeId Ast::AddIndex(uint32_t offset, NameId array, NodeId index) {
+    return AddNode(kNodeIndex, offset, array, index);
+}
 
-    // Register all variables and emit their initializer.
-    for (unsigned i = 0, e = var_names_.size(); i != e; ++i) {
-        const std::string &var_name = var_names_[i].first;
-        ExprAst *init = var_names_[i].second.get();
+NodeId Ast::AddAssignment(uint32_t offset, NameId name, NodeId value) {
+    return AddNode(kNodeAssignment, offset, name, value);
+}
 
-        Value *init_val;
-        if (init) {
-            init_val = init->CodeGen();
-            if (!init_val)
-                return nullptr;
-        } else {
-            // if there is no initializer, set to 0
-            init_val = ConstantFP::get(kTheContext, APFloat(0.0));
-        }
+NodeId Ast::AddReturn(uint32_t offset, NodeId value) {
+    return AddNode(kNodeReturn, offset, value);
+}
 
-        AllocaInst *alloca = CreateEntryBlockAlloca(the_function, var_name);
-        kBuilder.CreateStore(init_val, alloca);
+NodeId Ast::AddIf(uint32_t offset, NodeId cond, NodeId then_stat, NodeId else_stat) {
+    return AddNode(kNodeIf, offset, cond, then_stat, else_stat);
+}
 
-        // Remember the old variable binding 
-        // so that we can restore the binding when we unrecurse.
-        old_bindings.push_back(kNamedValues[var_name]);
+NodeId Ast::AddWhile(uint32_t offset, NodeId cond, NodeId body, const LoopHints &hints) {
+    uint32_t hints_at = extra_.size();
+    extra_.push_back(hints.unroll);
+    extra_.push_back(hints.vectorize_width);
+    extra_.push_back(hints.interleave);
+    return AddNode(kNodeWhile, offset, cond, body, hints_at);
+}
 
-        // Remember this binding.
-        kNamedValues[var_name] = alloca;
+NodeId Ast::AddCompound(uint32_t offset, llvm::ArrayRef<pair<NameId, NodeId>> vars,
+                        llvm::ArrayRef<NodeId> stats) {
+    vector<uint32_t> var_items;
+    for (auto &var : vars) {
+        var_items.push_back(var.first);
+        var_items.push_back(var.second);
     }
-
-    // Codegen the body.
-    if (!body_->CodeGen())
-        return nullptr;
-
-    std::cerr << "codegen cs success" << std::endl;
-
-    // Pop all our variables from scope.
-    for (unsigned i = 0, e = var_names_.size(); i != e; ++i)
-        kNamedValues[var_names_[i].first] = old_bindings[i];
-
-    return Constant::getNullValue(Type::getDoubleTy(kTheContext));
+    ListId var_list = AddList(var_items);
+    return AddNode(kNodeCompound, offset, var_list, AddList(stats));
 }
 
-Function *PrototypeAst::CodeGen() {
-    std::vector<Type *> doubles(args_.size(), Type::getDoubleTy(kTheContext));
-
-    FunctionType *ft = FunctionType::get(Type::getDoubleTy(kTheContext), doubles, false);
-
-    Function *f = Function::Create(ft, Function::ExternalLinkage, name_, kTheModule.get());
-
-    // Set names for all arguments.
-    unsigned idx = 0;
-    for (auto &arg : f->args())
-        arg.setName(args_[idx++]);
-
-    return f;
+NodeId Ast::AddPrototype(uint32_t offset, NameId name, llvm::ArrayRef<NameId> args) {
+    return AddNode(kNodePrototype, offset, name, AddList(args));
 }
 
-Function *FunctionAst::CodeGen() {
-    std::cerr << "1" << std::endl;
-    
-    // First check for an existing function from a previous "extern" declaration.
-    auto &p = *proto_;
-    kFunctionProtos[proto_->name()] = std::move(proto_);
-    Function *the_function = GetFunction(p.name());
-
-    if (!the_function)
-        the_function = proto_->CodeGen();
-    std::cerr << "2" << std::endl;
-
-    if (!the_function)
-        return nullptr;
-    std::cerr << "3" << std::endl;
+NodeId Ast::AddFunction(uint32_t offset, NodeId proto, NodeId body, uint16_t fp_flags) {
+    NodeId id = AddNode(kNodeFunction, offset, proto, body);
+    nodes_[id].flags = fp_flags;
+    return id;
+}
 
-    if (!the_function->empty())
-        return (Function*)LogErrorV("Function cannot be redefined.");
+NodeId Ast::AddGlobal(uint32_t offset, NameId name, bool is_const, uint32_t size,
+                      llvm::ArrayRef<NodeId> init) {
+    NodeId id = AddNode(kNodeGlobal, offset, name, AddList(init), size);
+    if (is_const)
+        nodes_[id].flags = kGlobalConst;
+    return id;
+}
 
-    // Create a new basic block to start insertion into.
-    BasicBlock *bb  = BasicBlock::Create(kTheContext, "entry", the_function);
-    kBuilder.SetInsertPoint(bb);
+LoopHints Ast::hints(NodeId while_stat) const {
+    const uint32_t *at = &extra_[nodes_[while_stat].c];
+    LoopHints hints;
+    hints.unroll = at[0];
+    hints.vectorize_width = at[1];
+    hints.interleave = at[2];
+    return hints;
+}
 
-    // Record the function arguments in the NamedValues map.
-    kNamedValues.clear();
-    for (auto &arg : the_function->args()) {
-        // Create an alloca for this argument.
-        AllocaInst *alloca = CreateEntryBlockAlloca(the_function, arg.getName());
+Prototype Ast::GetPrototype(NodeId id) const {
+    if (kind(id) == kNodeFunction)
+        id = nodes_[id].a;
 
-        // Store the initial value into the alloca.
-        kBuilder.CreateStore(&arg, alloca);
+    Prototype proto;
+    proto.name = name(nodes_[id].a).str();
+    for (NameId arg : list(nodes_[id].b))
+        proto.args.push_back(name(arg).str());
+    return proto;
+}
 
-        // Add  arguments to variable symbol table.
-        kNamedValues[arg.getName()] = alloca;
-    }
+static bool IsExpr(NodeKind kind) {
+    return kind == kNodeNumber || kind == kNodeVariable || kind == kNodeBinary || kind == kNodeCall ||
+           kind == kNodeIndex || kind == kNodeUnary;
+}
 
-    if (body_->CodeGen()) {
-        // Finish off the function.
-        //kBuilder.CreateRet(retval);
+static bool IsStat(NodeKind kind) {
+    return kind != kNodePrototype && kind != kNodeFunction && kind != kNodeGlobal;
+}
 
-        // Validate the generated code, checking for consistency.
-        verifyFunction(*the_function);
-        
-        //kTheFpm->run(*the_function);
+bool Ast::ValidList(ListId id) const {
+    return id < extra_.size() && size_t(extra_[id]) < extra_.size() - id;
+}
 
-        std::cerr << "4" << std::endl;
-        return the_function;
+bool Ast::Validate() const {
+    if (name_offsets_.empty() || name_offsets_[0] != 0 ||
+        name_offsets_.back() != name_chars_.size())
+        return false;
+    for (size_t i = 1; i < name_offsets_.size(); ++i)
+        if (name_offsets_[i - 1] > name_offsets_[i])
+            return false;
+
+    // children come before their parent, so the tree has no cycles, and
+    // are of the kinds the parser puts there
+    size_t names = num_names();
+    for (NodeId id = 0; id != nodes_.size(); ++id) {
+        const AstNode &node = nodes_[id];
+        auto expr = [&](NodeId child) { return child < id && IsExpr(nodes_[child].kind); };
+        auto stat = [&](NodeId child) { return child < id && IsStat(nodes_[child].kind); };
+        auto compound = [&](NodeId child) { return child < id && nodes_[child].kind == kNodeCompound; };
+        switch (node.kind) {
+        case kNodeNumber:
+            if (node.a >= numbers_.size())
+                return false;
+            break;
+        case kNodeVariable:
+            if (node.a >= names)
+                return false;
+            break;
+        case kNodeUnary:
+            if (!expr(node.a))
+                return false;
+            break;
+        case kNodeBinary:
+            if (!expr(node.a) || !expr(node.b))
+                return false;
+            break;
+        case kNodeCall:
+            if (node.a >= names || !ValidList(node.b))
+                return false;
+            for (NodeId arg : list(node.b))
+                if (!expr(arg))
+                    return false;
+            break;
+        case kNodeIndex:
+        case kNodeAssignment:
+            if (node.a >= names || !expr(node.b))
+                return false;
+            break;
+        case kNodeReturn:
+            if (!expr(node.a))
+                return false;
+            break;
+        case kNodeIf:
+            if (!expr(node.a) || !compound(node.b) || !compound(node.c))
+                return false;
+            break;
+        case kNodeWhile:
+            if (!expr(node.a) || !compound(node.b) || node.c > extra_.size() ||
+                extra_.size() - node.c < 3)
+                return false;
+            break;
+        case kNodeCompound: {
+            if (!ValidList(node.a) || !ValidList(node.b))
+                return false;
+            auto vars = list(node.a);
+            if (vars.size() % 2)
+                return false;
+            for (size_t i = 0; i < vars.size(); i += 2)
+                if (vars[i] >= names || (vars[i + 1] != kNoNode && !expr(vars[i + 1])))
+                    return false;
+            for (NodeId item : list(node.b))
+                if (!stat(item))
+                    return false;
+            break;
+        }
+        case kNodePrototype:
+            if (node.a >= names || !ValidList(node.b))
+                return false;
+            for (NameId arg : list(node.b))
+                if (arg >= names)
+                    return false;
+            break;
+        case kNodeFunction:
+            if (node.a >= id || nodes_[node.a].kind != kNodePrototype || !compound(node.b) ||
+                (node.flags & ~(kFpFast | kFpOverride)))
+                return false;
+            break;
+        case kNodeGlobal:
+            if (node.a >= names || !ValidList(node.b) || (node.flags & ~kGlobalConst) ||
+                (node.c == 0 && list(node.b).size() > 1))
+                return false;
+            for (NodeId item : list(node.b))
+                if (!expr(item))
+                    return false;
+            break;
+        default:
+            return false;
+        }
     }
 
-    // Error reading body, remove function.
-    the_function->eraseFromParent();
-
-    std::cerr << "5" << std::endl;
-    return nullptr;
+    for (NodeId id : top_level_)
+        if (id >= nodes_.size() || IsStat(kind(id)))
+            return false;
+    return true;
 }
-
-
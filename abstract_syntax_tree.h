@@ -2,198 +2,200 @@
 #define ABSTRACT_SYNTAX_TREE_H
 
 #include <string>
-#include <memory>
 #include <vector>
 #include <utility>
-#include <llvm-9/llvm/ADT/APFloat.h>
-#include <llvm-9/llvm/ADT/STLExtras.h>
-#include <llvm-9/llvm/IR/BasicBlock.h>
-#include <llvm-9/llvm/IR/Constants.h>
-#include <llvm-9/llvm/IR/DerivedTypes.h>
-#include <llvm-9/llvm/IR/Function.h>
-#include <llvm-9/llvm/IR/Value.h>
-#include <llvm-9/llvm/IR/IRBuilder.h>
-#include <llvm-9/llvm/IR/LLVMContext.h>
-#include <llvm-9/llvm/IR/Module.h>
-#include <llvm-9/llvm/IR/Type.h>
-#include <llvm-9/llvm/IR/Verifier.h>
-#include <llvm-9/llvm/IR/LegacyPassManager.h>
-#include <llvm-9/llvm/IR/Instructions.h>
-#include "KaleidoscopeJIT.h"
-
-
-class PrototypeAst;
-
-//namespace {
-
-/// Ast - Base class for all AST nodes.
-class Ast {
-protected:
-    /* LLVM objects */
-//        static llvm::LLVMContext the_context_;
-//        static llvm::IRBuilder<> builder_(llvm::LLVMContext(the_context_));
-//        static std::unique_ptr<llvm::Module> the_module_;
-//        static std::map<std::string, llvm::Value *> named_values_;
-public:
-    virtual ~Ast() = default;
-};
-// initialization
-//    llvm::IRBuilder<> Ast::builder_ = llvm::IRBuilder<>(Ast::the_context_);
-
-/// ExprAST - Base class for all expression nodes.
-class ExprAst : public Ast{
-public:
-    virtual ~ExprAst() = default;
-    virtual llvm::Value *CodeGen() = 0;
-};
-
-/// NumberExprAST - Expression class for numeric literals like "1.0".
-class NumberExprAst : public ExprAst {
-protected:
-    double val_;
-public:
-    NumberExprAst(double val) : val_(val) {}
-    llvm::Value *CodeGen() override;
-};
-
-/// VariableExprAST - Expression class for referencing a variable, like "a".
-class VariableExprAst : public ExprAst {
-protected:
-    std::string name_;
-public:
-    VariableExprAst(const std::string &name) : name_(name) {}
-    const std::string &name() const { return name_; };
-    llvm::Value *CodeGen() override;
-};
-
-/// BinaryExprAST - Expression class for a binary operator.
-class BinaryExprAst : public ExprAst {
-protected:
-    char op_;
-    std::unique_ptr<ExprAst> lhs_, rhs_;
-public:
-    BinaryExprAst(char op, std::unique_ptr<ExprAst> lhs, 
-                    std::unique_ptr<ExprAst> rhs)
-        : op_(op), lhs_(std::move(lhs)), rhs_(std::move(rhs)) {}
-    llvm::Value *CodeGen() override;
-};
-
-/// CallExprAST - Expression class for function calls.
-class CallExprAst : public ExprAst {
-protected:
-    std::string callee_;
-    std::vector<std::unique_ptr<ExprAst>> args_;
-public:
-    CallExprAst(const std::string &callee, std::vector<std::unique_ptr<ExprAst>> args)
-        : callee_(callee), args_(std::move(args)) {}
-    llvm::Value *CodeGen() override;
-};
-
-/// 语句
-class StatAst {
-public:
-    virtual ~StatAst() = default;
-    virtual llvm::Value *CodeGen() = 0;
-};
-
-
-/// 语句串
-class StatListAst {
-protected:
-    std::vector<std::unique_ptr<StatAst>> stat_list_;
-public:
-    StatListAst(std::vector<std::unique_ptr<StatAst>> stat_list)
-        : stat_list_(std::move(stat_list)) {}
-    llvm::Value *CodeGen();
-};
-
-/// 语句块
-class CompoundStatAst {
-protected:
-    std::vector<std::pair<std::string, std::unique_ptr<ExprAst>>> var_names_;
-    //std::unique_ptr<ExprAst> body_;
-    std::unique_ptr<StatListAst> body_;
-public:
-    // IntExprAst allows a list of names to be defined all at once,
-    // and each name can optionally have an initializer value.
-    CompoundStatAst(std::vector<std::pair<std::string, std::unique_ptr<ExprAst>>> var_names, std::unique_ptr<StatListAst> body)
-        : var_names_(std::move(var_names)), body_(std::move(body)) {}
-
-    llvm::Value *CodeGen();
+#include <cstdint>
+#include <memory>
+#include <llvm-9/llvm/ADT/ArrayRef.h>
+#include <llvm-9/llvm/ADT/StringMap.h>
+#include <llvm-9/llvm/ADT/StringRef.h>
+
+// An AST is a set of flat arrays. Nodes refer to their children, names and
+// lists by 32-bit indexes instead of pointers, a node is always added after
+// its children. Passes walk it with a switch over the node kind.
+
+// index of a node in its Ast
+typedef uint32_t NodeId;
+// index of an interned name in its Ast
+typedef uint32_t NameId;
+// index of a list in the extra data of its Ast: the length, then the items
+typedef uint32_t ListId;
+
+// no node, e.g. a variable without initializer
+const NodeId kNoNode = ~NodeId(0);
+
+/// NodeKind - what a node is, and what its fields a, b and c hold.
+enum NodeKind : uint8_t {
+    kNodeNumber,       // a: index into the numbers
+    kNodeVariable,     // a: name
+    kNodeBinary,       // op: operator, a: lhs, b: rhs
+    kNodeCall,         // a: callee name, b: list of argument expressions
+    kNodeIndex,        // a: array name, b: index expression
+    kNodeUnary,        // op: operator, a: operand
+    kNodeAssignment,   // a: name, b: value
+    kNodeReturn,       // a: value
+    kNodeIf,           // a: condition, b: then compound, c: else compound
+    kNodeWhile,        // a: condition, b: body compound, c: extra index of the LoopHints
+    kNodeCompound,     // a: list of variables as (name, initializer or kNoNode)
+                       //    pairs, b: list of statements
+    kNodePrototype,    // a: name, b: list of argument names
+    kNodeFunction,     // a: prototype, b: body compound; flags: kFp*
+    kNodeGlobal        // a: name, b: list of initializer expressions, c: array
+                       //    size, 0 for a scalar; flags: kGlobalConst
 };
 
-/// 赋值语句
-class AssignmentStatAst : public StatAst {
-protected:
-    std::string name_;
-    std::unique_ptr<ExprAst> expr_;
-public:
-    AssignmentStatAst(std::string name, std::unique_ptr<ExprAst> expr)
-        :name_(name), expr_(std::move(expr)) {}
-    llvm::Value *CodeGen() override;
+// operators of kNodeBinary spelled with two characters, the others are
+// their character
+enum : uint8_t {
+    kOpLessEqual = 128,
+    kOpGreaterEqual,
+    kOpEqual,
+    kOpNotEqual,
+    kOpAnd,
+    kOpOr
 };
 
-/// return 语句
-class ReturnStatAst : public StatAst {
-protected:
-    std::unique_ptr<ExprAst> expr_;
-public:
-    ReturnStatAst(std::unique_ptr<ExprAst> expr)
-        : expr_(std::move(expr)) {}
-    llvm::Value *CodeGen() override;
+// flags of a kNodeGlobal
+const uint16_t kGlobalConst = 1;
+
+// flags of a kNodeFunction with a #pragma fp in front, the fast-math flags
+// of its body instead of the ones of the command line
+const uint16_t kFpReassoc = 1 << 0;
+const uint16_t kFpNoNaNs = 1 << 1;
+const uint16_t kFpNoInfs = 1 << 2;
+const uint16_t kFpNoSignedZeros = 1 << 3;
+const uint16_t kFpAllowReciprocal = 1 << 4;
+const uint16_t kFpContract = 1 << 5;
+const uint16_t kFpApproxFunc = 1 << 6;
+const uint16_t kFpFast = (1 << 7) - 1;
+const uint16_t kFpOverride = 1 << 15;
+
+struct AstNode {
+    NodeKind kind;
+    // operator of kNodeBinary and kNodeUnary, its character or a kOp code
+    uint8_t op;
+    // kind specific bits, see kGlobalConst and kFpOverride
+    uint16_t flags;
+    // source offset, for diagnostics
+    uint32_t offset;
+    uint32_t a, b, c;
 };
 
-/// IfExprAST - Expression class for if/then/else.
-class IfStatAst : public StatAst {
-protected:
-    std::unique_ptr<ExprAst> cond_;
-    std::unique_ptr<CompoundStatAst> then_;
-    std::unique_ptr<CompoundStatAst> else_;
-public:
-    IfStatAst(std::unique_ptr<ExprAst> c, std::unique_ptr<CompoundStatAst> t,
-              std::unique_ptr<CompoundStatAst> e)
-        : cond_(std::move(c)), then_(std::move(t)), else_(std::move(e)) {}
-    llvm::Value *CodeGen() override;
+/// LoopHints - the #pragma lines in front of a while, 0 means no hint.
+struct LoopHints {
+    // unroll(n), 1 disables unrolling
+    uint32_t unroll = 0;
+    // vectorize(n), 1 disables vectorization
+    uint32_t vectorize_width = 0;
+    // interleave(n)
+    uint32_t interleave = 0;
 };
 
-/// WhileExpreAst - Expression class for while
-class WhileStatAst : public StatAst {
-protected:
-    std::unique_ptr<ExprAst> cond_;
-    std::unique_ptr<CompoundStatAst> body_;
-public:
-    WhileStatAst(std::unique_ptr<ExprAst> cond, std::unique_ptr<CompoundStatAst> body)
-        : cond_(std::move(cond)), body_(std::move(body)) {}
-    llvm::Value *CodeGen() override;
+/// Prototype - name and argument names of a function. It is copied out of
+/// its Ast into CompilerState::function_protos, so the function can still
+/// be declared after the Ast is gone.
+struct Prototype {
+    std::string name;
+    std::vector<std::string> args;
+    // only declared by an extern, no module seen defines it
+    bool is_extern = false;
 };
 
-/// PrototypeAST - This class represents the "prototype" for a function,
-/// which captures its name, and its argument names (thus implicitly the number
-/// of arguments the function takes).
-class PrototypeAst : public Ast{
-protected:
-    std::string name_;
-    std::vector<std::string> args_;
-public:
-    PrototypeAst(const std::string &name, std::vector<std::string> args)
-        : name_(name), args_(std::move(args)) {}
-    const std::string &name() const { return name_; };
-    llvm::Function *CodeGen();
+/// GlobalDecl - a module-level variable with its initial values folded, an
+/// array of size doubles or a scalar if size is 0. Like a Prototype it is
+/// kept in CompilerState::globals, so later modules can declare it.
+struct GlobalDecl {
+    std::string name;
+    bool is_const = false;
+    uint32_t size = 0;
+    // one value per element, or the one of a scalar
+    std::vector<double> values;
 };
 
-/// FunctionAST - This class represents a function definition itself.
-class FunctionAst : public Ast{
-protected:
-    std::unique_ptr<PrototypeAst> proto_;
-    std::unique_ptr<CompoundStatAst> body_;
+/// Ast - the nodes of one source, or of one AST file.
+class Ast {
+private:
+    std::vector<AstNode> nodes_;
+    std::vector<uint32_t> extra_;
+    std::vector<double> numbers_;
+    // interned names, name i is name_chars_[name_offsets_[i], name_offsets_[i + 1])
+    llvm::StringMap<NameId> name_ids_;
+    std::vector<uint32_t> name_offsets_;
+    std::string name_chars_;
+    // definitions, externs and globals in source order
+    std::vector<NodeId> top_level_;
+
+    NodeId AddNode(NodeKind kind, uint32_t offset, uint32_t a, uint32_t b = 0, uint32_t c = 0);
+    ListId AddList(llvm::ArrayRef<uint32_t> items);
+
+    // checks the indexes of an Ast read from a file
+    bool Validate() const;
+    bool ValidList(ListId id) const;
+
+    friend std::unique_ptr<Ast> ReadAstFile(const std::string &path, const char magic[4]);
 public:
-    FunctionAst(std::unique_ptr<PrototypeAst> proto,
-                std::unique_ptr<CompoundStatAst> body)
-        : proto_(std::move(proto)), body_(std::move(body)) {}
-    llvm::Function *CodeGen();
+    Ast() : name_offsets_(1, 0) {}
+
+    NameId Intern(llvm::StringRef name);
+
+    NodeId AddNumber(uint32_t offset, double val);
+    // The builders taking a name intern it, the parser passes the NameId
+    // it interned when it read the identifier.
+    NodeId AddVariable(uint32_t offset, NameId name);
+    NodeId AddVariable(uint32_t offset, llvm::StringRef name) { return AddVariable(offset, Intern(name)); }
+    NodeId AddUnary(uint32_t offset, uint8_t op, NodeId operand);
+    NodeId AddBinary(uint32_t offset, uint8_t op, NodeId lhs, NodeId rhs);
+    NodeId AddCall(uint32_t offset, NameId callee, llvm::ArrayRef<NodeId> args);
+    NodeId AddCall(uint32_t offset, llvm::StringRef callee, llvm::ArrayRef<NodeId> args) {
+        return AddCall(offset, Intern(callee), args);
+    }
+    NodeId AddIndex(uint32_t offset, NameId array, NodeId index);
+    NodeId AddIndex(uint32_t offset, llvm::StringRef array, NodeId index) {
+        return AddIndex(offset, Intern(array), index);
+    }
+    NodeId AddAssignment(uint32_t offset, NameId name, NodeId value);
+    NodeId AddAssignment(uint32_t offset, llvm::StringRef name, NodeId value) {
+        return AddAssignment(offset, Intern(name), value);
+    }
+    NodeId AddReturn(uint32_t offset, NodeId value);
+    NodeId AddIf(uint32_t offset, NodeId cond, NodeId then_stat, NodeId else_stat);
+    NodeId AddWhile(uint32_t offset, NodeId cond, NodeId body, const LoopHints &hints);
+    NodeId AddCompound(uint32_t offset, llvm::ArrayRef<std::pair<NameId, NodeId>> vars,
+                       llvm::ArrayRef<NodeId> stats);
+    NodeId AddPrototype(uint32_t offset, NameId name, llvm::ArrayRef<NameId> args);
+    NodeId AddPrototype(uint32_t offset, llvm::StringRef name, llvm::ArrayRef<NameId> args) {
+        return AddPrototype(offset, Intern(name), args);
+    }
+    NodeId AddFunction(uint32_t offset, NodeId proto, NodeId body, uint16_t fp_flags = 0);
+    NodeId AddGlobal(uint32_t offset, NameId name, bool is_const, uint32_t size,
+                     llvm::ArrayRef<NodeId> init);
+    NodeId AddGlobal(uint32_t offset, llvm::StringRef name, bool is_const, uint32_t size,
+                     llvm::ArrayRef<NodeId> init) {
+        return AddGlobal(offset, Intern(name), is_const, size, init);
+    }
+
+    void AddTopLevel(NodeId id) { top_level_.push_back(id); }
+
+    const AstNode &node(NodeId id) const { return nodes_[id]; }
+    NodeKind kind(NodeId id) const { return nodes_[id].kind; }
+    size_t size() const { return nodes_.size(); }
+    llvm::ArrayRef<NodeId> top_level() const { return top_level_; }
+
+    double number(NodeId id) const { return numbers_[nodes_[id].a]; }
+    llvm::StringRef name(NameId id) const {
+        return llvm::StringRef(name_chars_.data() + name_offsets_[id],
+                               name_offsets_[id + 1] - name_offsets_[id]);
+    }
+    size_t num_names() const { return name_offsets_.size() - 1; }
+    llvm::ArrayRef<uint32_t> list(ListId id) const {
+        return llvm::ArrayRef<uint32_t>(extra_.data() + id + 1, extra_[id]);
+    }
+    LoopHints hints(NodeId while_stat) const;
+
+    // The prototype of a kNodePrototype or kNodeFunction.
+    Prototype GetPrototype(NodeId id) const;
+
+    friend bool WriteAstFile(const Ast &ast, const std::string &path, const char magic[4]);
 };
 
-
-//} // end anonymous namespace
-
 #endif
@@ -0,0 +1,213 @@
+#include "ast_serializer.h"
+#include "codegen.h"
+#include "resolver.h"
+#include "tools.h"
+#include "compiler_state.h"
+#include <cstring>
+#include <iostream>
+#include <llvm-9/llvm/ADT/StringSet.h>
+#include <llvm-9/llvm/Support/FileSystem.h>
+#include <llvm-9/llvm/Support/MemoryBuffer.h>
+#include <llvm-9/llvm/Support/raw_ostream.h>
+
+using namespace std;
+
+template <typename T>
+static void WriteArray(llvm::raw_ostream &out, const vector<T> &array) {
+    out.write(reinterpret_cast<const char *>(array.data()), array.size() * sizeof(T));
+}
+
+bool WriteAstFile(const Ast &ast, const string &path, const char magic[4]) {
+    AstFileHeader header;
+    memcpy(header.magic, magic, sizeof(header.magic));
+    header.version = kAstFileVersion;
+    header.num_numbers = ast.numbers_.size();
+    header.num_nodes = ast.nodes_.size();
+    header.num_extra = ast.extra_.size();
+    header.num_top_level = ast.top_level_.size();
+    header.num_names = ast.num_names();
+    header.name_bytes = ast.name_chars_.size();
+
+    error_code ec;
+    llvm::raw_fd_ostream out(path, ec, llvm::sys::fs::OF_None);
+    if (ec) {
+        kState->diags.Error("Could not open file: " + ec.message());
+        return false;
+    }
+
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    WriteArray(out, ast.numbers_);
+    WriteArray(out, ast.nodes_);
+    WriteArray(out, ast.extra_);
+    WriteArray(out, ast.top_level_);
+    WriteArray(out, ast.name_offsets_);
+    out << ast.name_chars_;
+
+    out.close();
+    if (out.has_error()) {
+        out.clear_error();
+        return false;
+    }
+    return true;
+}
+
+// Copy count items of T at cur into array, false if they run past end.
+template <typename T>
+static bool ReadArray(const char *&cur, const char *end, size_t count, vector<T> &array) {
+    if (count > size_t(end - cur) / sizeof(T))
+        return false;
+    array.resize(count);
+    memcpy(array.data(), cur, count * sizeof(T));
+    cur += count * sizeof(T);
+    return true;
+}
+
+unique_ptr<Ast> ReadAstFile(const string &path, const char magic[4]) {
+    // Large files are mmapped by MemoryBuffer.
+    auto buffer_or_err = llvm::MemoryBuffer::getFile(path, -1, false);
+    if (!buffer_or_err)
+        return nullptr;
+    const char *cur = (*buffer_or_err)->getBufferStart();
+    const char *end = (*buffer_or_err)->getBufferEnd();
+
+    if (size_t(end - cur) < sizeof(AstFileHeader))
+        return nullptr;
+    AstFileHeader header;
+    memcpy(&header, cur, sizeof(header));
+    cur += sizeof(header);
+    if (memcmp(header.magic, magic, sizeof(header.magic)) != 0 ||
+        header.version != kAstFileVersion)
+        return nullptr;
+
+    unique_ptr<Ast> ast(new Ast());
+    if (!ReadArray(cur, end, header.num_numbers, ast->numbers_) ||
+        !ReadArray(cur, end, header.num_nodes, ast->nodes_) ||
+        !ReadArray(cur, end, header.num_extra, ast->extra_) ||
+        !ReadArray(cur, end, header.num_top_level, ast->top_level_) ||
+        !ReadArray(cur, end, size_t(header.num_names) + 1, ast->name_offsets_) ||
+        size_t(end - cur) != header.name_bytes)
+        return nullptr;
+    ast->name_chars_.assign(cur, header.name_bytes);
+
+    if (!ast->Validate())
+        return nullptr;
+    for (NameId id = 0; id != ast->num_names(); ++id)
+        ast->name_ids_.insert(make_pair(ast->name(id), id));
+    return ast;
+}
+
+bool LoadAstFile(const string &path) {
+    auto ast = ReadAstFile(path, kAstFileMagic);
+    if (!ast) {
+        kState->diags.Error("fail to open AST file " + path);
+        return false;
+    }
+
+    // no source to point into, errors only name the file
+    kState->diags.SetSource(path, llvm::StringRef());
+
+    // Every prototype before any body, a definition may call a later one.
+    // The first declaration of a name counts, as in CollectDeclarations.
+    llvm::StringSet<> declared;
+    for (NodeId id : ast->top_level()) {
+        if (ast->kind(id) == kNodeGlobal)
+            continue;
+        bool definition = ast->kind(id) == kNodeFunction;
+        Prototype proto = ast->GetPrototype(id);
+        proto.is_extern = !definition;
+        if (declared.insert(proto.name).second)
+            kState->function_protos[proto.name] = move(proto);
+        else if (definition)
+            kState->function_protos[proto.name].is_extern = false;
+    }
+
+    Resolution resolution;
+    Resolver resolver(*ast, resolution);
+    CodeGenerator code_generator(*ast, resolution);
+    for (NodeId id : ast->top_level()) {
+        if (!resolver.Resolve(id))
+            continue;
+        if (ast->kind(id) == kNodeFunction) {
+            auto *fn_ir = code_generator.EmitFunction(id);
+            if (kState->map_entry_points)
+                CreateMapEntryPoint(fn_ir);
+        } else if (ast->kind(id) == kNodeGlobal) {
+            code_generator.EmitGlobal(id);
+        } else {
+            // extern
+            code_generator.EmitExtern(id);
+        }
+    }
+    kState->diags.ClearSource();
+
+    return true;
+}
+
+bool WriteModuleSummary(const string &path) {
+    Ast summary;
+    for (auto &f : *kState->the_module) {
+        if (f.isDeclaration())
+            continue;
+        auto fi = kState->function_protos.find(f.getName().str());
+        if (fi == kState->function_protos.end())
+            continue;
+
+        vector<NameId> args;
+        for (auto &arg : fi->second.args)
+            args.push_back(summary.Intern(arg));
+        summary.AddTopLevel(summary.AddPrototype(0, fi->second.name, args));
+    }
+
+    // globals with their folded values as initializers
+    for (auto &gv : kState->the_module->globals()) {
+        if (gv.isDeclarationForLinker())
+            continue;
+        auto gi = kState->globals.find(gv.getName().str());
+        if (gi == kState->globals.end())
+            continue;
+
+        vector<NodeId> init;
+        for (double val : gi->second.values)
+            init.push_back(summary.AddNumber(0, val));
+        summary.AddTopLevel(summary.AddGlobal(0, gi->second.name, gi->second.is_const,
+                                              gi->second.size, init));
+    }
+    return WriteAstFile(summary, path, kModuleSummaryMagic);
+}
+
+bool ImportModuleSummary(const string &path) {
+    auto summary = ReadAstFile(path, kModuleSummaryMagic);
+    if (!summary) {
+        kState->diags.Error("fail to open module summary " + path);
+        return false;
+    }
+
+    // Only register the prototypes and globals, GetFunction and GetGlobal
+    // declare them on first use.
+    Resolution no_slots;
+    CodeGenerator code_generator(*summary, no_slots);
+    for (NodeId id : summary->top_level()) {
+        if (summary->kind(id) == kNodeGlobal) {
+            // A summary holds every element of a global as a number, the
+            // size must not be taken unchecked, FoldGlobal allocates it.
+            const AstNode &node = summary->node(id);
+            auto items = summary->list(node.b);
+            bool malformed = items.size() != max<uint32_t>(node.c, 1);
+            for (NodeId item : items)
+                malformed |= summary->kind(item) != kNodeNumber;
+            if (malformed) {
+                kState->diags.Error("malformed module summary " + path);
+                return false;
+            }
+            GlobalDecl global = code_generator.FoldGlobal(id);
+            string name = global.name;
+            kState->globals[name] = move(global);
+            continue;
+        }
+
+        Prototype proto = summary->GetPrototype(id);
+        string name = proto.name;
+        kState->function_protos[name] = move(proto);
+    }
+    return true;
+}
@@ -0,0 +1,62 @@
+#ifndef AST_SERIALIZER_H
+#define AST_SERIALIZER_H
+
+#include <string>
+#include <memory>
+#include <cstdint>
+#include "abstract_syntax_tree.h"
+
+// Binary AST files, the arrays of an Ast as they are in memory.
+//
+// Layout, all fields in host byte order:
+//   AstFileHeader
+//   double    numbers[num_numbers]
+//   AstNode   nodes[num_nodes]
+//   uint32_t  extra[num_extra]
+//   uint32_t  top_level[num_top_level]
+//   uint32_t  name_offsets[num_names + 1]
+//   char      name_chars[name_bytes]
+//
+// The header is 32 bytes, so the numbers are 8 byte aligned in a mapped
+// file and every array after them 4 byte aligned.
+//
+// A ".yca" file holds the top-level definitions, externs and globals of a
+// source, a ".ycs" module summary holds only the prototypes and the globals,
+// with their folded initial values, a module defines.
+
+const char kAstFileMagic[4] = {'Y', 'C', 'A', 'S'};
+const char kModuleSummaryMagic[4] = {'Y', 'C', 'M', 'S'};
+const uint32_t kAstFileVersion = 5;
+
+struct AstFileHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t num_numbers;
+    uint32_t num_nodes;
+    uint32_t num_extra;
+    uint32_t num_top_level;
+    uint32_t num_names;
+    uint32_t name_bytes;
+};
+
+// Write ast with the given magic. False if the file could not be written.
+bool WriteAstFile(const Ast &ast, const std::string &path, const char magic[4]);
+
+// Read an Ast written by WriteAstFile. Every index in it is checked, so code
+// can be generated from it as from a parsed Ast. Returns nullptr if path is
+// missing, not an AST file with this magic, or malformed.
+std::unique_ptr<Ast> ReadAstFile(const std::string &path, const char magic[4]);
+
+// Generate code for every top-level node of a ".yca" file into the module
+// of kState.
+bool LoadAstFile(const std::string &path);
+
+// Write the prototypes of all functions and the globals defined in the
+// module of kState.
+bool WriteModuleSummary(const std::string &path);
+
+// Make the prototypes of a ".ycs" file callable without an extern, and its
+// globals usable without a declaration.
+bool ImportModuleSummary(const std::string &path);
+
+#endif
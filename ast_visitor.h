@@ -0,0 +1,120 @@
+#ifndef AST_VISITOR_H
+#define AST_VISITOR_H
+
+#include "abstract_syntax_tree.h"
+
+/// AstVisitor - walks the nodes of an Ast. Derived overrides the Visit<Kind>
+/// methods it cares about, the others visit the children of the node in
+/// source order. Calls are resolved at compile time, as in
+///
+///   class Counter : public AstVisitor<Counter> {
+///   public:
+///       unsigned calls = 0;
+///       Counter(const Ast &ast) : AstVisitor(ast) {}
+///       void VisitCall(NodeId id) { ++calls; VisitChildren(id); }
+///   };
+template <typename Derived>
+class AstVisitor {
+protected:
+    const Ast &ast_;
+
+    Derived &derived() { return *static_cast<Derived *>(this); }
+public:
+    AstVisitor(const Ast &ast) : ast_(ast) {}
+
+    void Visit(NodeId id) {
+        switch (ast_.kind(id)) {
+        case kNodeNumber:
+            return derived().VisitNumber(id);
+        case kNodeVariable:
+            return derived().VisitVariable(id);
+        case kNodeBinary:
+            return derived().VisitBinary(id);
+        case kNodeCall:
+            return derived().VisitCall(id);
+        case kNodeIndex:
+            return derived().VisitIndex(id);
+        case kNodeUnary:
+            return derived().VisitUnary(id);
+        case kNodeAssignment:
+            return derived().VisitAssignment(id);
+        case kNodeReturn:
+            return derived().VisitReturn(id);
+        case kNodeIf:
+            return derived().VisitIf(id);
+        case kNodeWhile:
+            return derived().VisitWhile(id);
+        case kNodeCompound:
+            return derived().VisitCompound(id);
+        case kNodePrototype:
+            return derived().VisitPrototype(id);
+        case kNodeFunction:
+            return derived().VisitFunction(id);
+        case kNodeGlobal:
+            return derived().VisitGlobal(id);
+        }
+    }
+
+    void VisitChildren(NodeId id) {
+        const AstNode &node = ast_.node(id);
+        switch (node.kind) {
+        case kNodeNumber:
+        case kNodeVariable:
+        case kNodePrototype:
+            break;
+        case kNodeBinary:
+        case kNodeFunction:
+            Visit(node.a);
+            Visit(node.b);
+            break;
+        case kNodeCall:
+        case kNodeGlobal:
+            for (NodeId item : ast_.list(node.b))
+                Visit(item);
+            break;
+        case kNodeIndex:
+        case kNodeAssignment:
+            Visit(node.b);
+            break;
+        case kNodeUnary:
+        case kNodeReturn:
+            Visit(node.a);
+            break;
+        case kNodeIf:
+            Visit(node.a);
+            Visit(node.b);
+            Visit(node.c);
+            break;
+        case kNodeWhile:
+            Visit(node.a);
+            Visit(node.b);
+            break;
+        case kNodeCompound: {
+            llvm::ArrayRef<uint32_t> vars = ast_.list(node.a);
+            for (size_t i = 1; i < vars.size(); i += 2)
+                if (vars[i] != kNoNode)
+                    Visit(vars[i]);
+            for (NodeId stat : ast_.list(node.b))
+                Visit(stat);
+            break;
+        }
+        }
+    }
+
+    void VisitNumber(NodeId id) { VisitChildren(id); }
+    void VisitVariable(NodeId id) { VisitChildren(id); }
+    void VisitBinary(NodeId id) { VisitChildren(id); }
+    void VisitCall(NodeId id) { VisitChildren(id); }
+    void VisitIndex(NodeId id) { VisitChildren(id); }
+    void VisitUnary(NodeId id) { VisitChildren(id); }
+    void VisitAssignment(NodeId id) { VisitChildren(id); }
+    void VisitReturn(NodeId id) { VisitChildren(id); }
+    void VisitIf(NodeId id) { VisitChildren(id); }
+    void VisitWhile(NodeId id) { VisitChildren(id); }
+    void VisitCompound(NodeId id) { VisitChildren(id); }
+    void VisitPrototype(NodeId id) { VisitChildren(id); }
+    void VisitFunction(NodeId id) { VisitChildren(id); }
+    void VisitGlobal(NodeId id) { VisitChildren(id); }
+};
+
+#endif
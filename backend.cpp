@@ -0,0 +1,315 @@
+#include "backend.h"
+#include "compiler_state.h"
+#include "tools.h"
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Object/ArchiveWriter.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/AlwaysInliner.h"
+#include "llvm/Transforms/IPO/Internalize.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
+
+using namespace std;
+
+static void InitializeTargets() {
+    // Initialize the target registry etc.
+    llvm::InitializeAllTargetInfos();
+    llvm::InitializeAllTargets();
+    llvm::InitializeAllTargetMCs();
+    llvm::InitializeAllAsmParsers();
+    llvm::InitializeAllAsmPrinters();
+}
+
+unique_ptr<llvm::TargetMachine> CreateTargetMachine(const BackendOptions &options) {
+    // also called from the code generation threads
+    static once_flag targets_initialized;
+    call_once(targets_initialized, InitializeTargets);
+
+    auto target_triple = llvm::sys::getDefaultTargetTriple();
+
+    string error;
+    auto target = llvm::TargetRegistry::lookupTarget(target_triple, error);
+
+    if (!target) {
+        llvm::errs() << error;
+        return nullptr;
+    }
+
+    auto cpu = "generic";
+    auto features = "";
+
+    llvm::TargetOptions opt;
+    opt.EnableFastISel = options.isel == kIselFast;
+    opt.EnableGlobalISel = options.isel == kIselGlobal;
+    // functions GlobalISel can't select fall back to SelectionDAG
+    opt.GlobalISelAbort = llvm::GlobalISelAbortMode::Disable;
+    // Defaults only, the attributes of a function replace them. Contraction
+    // is left to the contract flag of each instruction, so a function with
+    // #pragma fp(strict) gets no fused operations.
+    opt.UnsafeFPMath = options.fast_math.isFast();
+    opt.NoNaNsFPMath = options.fast_math.noNaNs();
+    opt.NoInfsFPMath = options.fast_math.noInfs();
+    opt.NoSignedZerosFPMath = options.fast_math.noSignedZeros();
+
+    llvm::CodeGenOpt::Level levels[] = {llvm::CodeGenOpt::None, llvm::CodeGenOpt::Less,
+                                        llvm::CodeGenOpt::Default, llvm::CodeGenOpt::Aggressive};
+    auto rm = llvm::Optional<llvm::Reloc::Model>();
+    auto cm = llvm::Optional<llvm::CodeModel::Model>();
+    return unique_ptr<llvm::TargetMachine>(
+        target->createTargetMachine(target_triple, cpu, features, opt, rm, cm,
+                                    levels[min(options.opt_level, 3u)]));
+}
+
+void PrepareModule(llvm::Module &module, llvm::TargetMachine &tm) {
+    module.setTargetTriple(tm.getTargetTriple().str());
+    module.setDataLayout(tm.createDataLayout());
+}
+
+// Moves the cold blocks a profile found out of their functions. Added as an
+// extension, PassManagerBuilder only has a process-wide flag for it.
+static void AddHotColdSplit(const llvm::PassManagerBuilder &, llvm::legacy::PassManagerBase &pm) {
+    pm.add(llvm::createHotColdSplittingPass());
+}
+
+void OptimizeModule(llvm::Module &module, llvm::TargetMachine &tm,
+                    const BackendOptions &options, bool lto) {
+    bool pgo = options.profile_generate || !options.profile_use_path.empty();
+    if (options.opt_level == 0 && !pgo)
+        return;
+
+    llvm::PassManagerBuilder builder;
+    builder.OptLevel = options.opt_level;
+    if (options.opt_level > 0)
+        builder.Inliner = llvm::createFunctionInliningPass(options.opt_level, 0, false);
+    else
+        builder.Inliner = llvm::createAlwaysInlinerLegacyPass();
+    auto *library_info = new llvm::TargetLibraryInfoImpl(llvm::Triple(module.getTargetTriple()));
+    library_info->addVectorizableFunctionsFromVecLib(options.vector_library);
+    builder.LibraryInfo = library_info;
+    builder.LoopVectorize = options.opt_level > 1;
+    builder.SLPVectorize = options.opt_level > 1;
+    tm.adjustPassManager(builder);
+
+    // The use side annotates branch weights and function entry counts,
+    // which drive block placement, inlining and hot/cold splitting.
+    builder.EnablePGOInstrGen = options.profile_generate;
+    builder.PGOInstrGen = options.profile_generate_path;
+    builder.PGOInstrUse = options.profile_use_path;
+    if (!options.profile_use_path.empty())
+        builder.addExtension(llvm::PassManagerBuilder::EP_OptimizerLast, AddHotColdSplit);
+
+    llvm::legacy::FunctionPassManager fpm(&module);
+    fpm.add(llvm::createTargetTransformInfoWrapperPass(tm.getTargetIRAnalysis()));
+    builder.populateFunctionPassManager(fpm);
+
+    llvm::legacy::PassManager mpm;
+    mpm.add(llvm::createTargetTransformInfoWrapperPass(tm.getTargetIRAnalysis()));
+    builder.populateModulePassManager(mpm);
+    // Cross module inlining, IPO and global DCE over the merged module.
+    if (lto)
+        builder.populateLTOPassManager(mpm);
+
+    fpm.doInitialization();
+    for (auto &f : module)
+        fpm.run(f);
+    fpm.doFinalization();
+
+    mpm.run(module);
+}
+
+static bool EmitToStream(llvm::Module &module, llvm::TargetMachine &tm, EmitKind kind,
+                         llvm::raw_pwrite_stream &dest) {
+    switch (kind) {
+    case kEmitLlvmIr:
+        module.print(dest, nullptr);
+        return true;
+    case kEmitBitcode:
+        llvm::WriteBitcodeToFile(module, dest);
+        return true;
+    default:
+        break;
+    }
+
+    llvm::legacy::PassManager pass;
+    auto file_type = kind == kEmitAssembly ? llvm::TargetMachine::CGFT_AssemblyFile
+                                           : llvm::TargetMachine::CGFT_ObjectFile;
+
+    if (tm.addPassesToEmitFile(pass, dest, nullptr, file_type, !kVerifyIr)) {
+        llvm::errs() << "TheTargetMachine can't emit a file of this type";
+        return false;
+    }
+
+    pass.run(module);
+    return true;
+}
+
+bool EmitFile(llvm::Module &module, llvm::TargetMachine &tm, EmitKind kind, const string &path) {
+    error_code ec;
+    auto flags = kind == kEmitObject || kind == kEmitBitcode ? llvm::sys::fs::OF_None
+                                                             : llvm::sys::fs::OF_Text;
+    llvm::raw_fd_ostream dest(path, ec, flags);
+
+    if (ec) {
+        llvm::errs() << "Could not open file: " << ec.message();
+        return false;
+    }
+
+    // The object writer seeks back, a pipe has to be buffered.
+    if (kind == kEmitObject && !dest.supportsSeeking()) {
+        llvm::buffer_ostream buffered(dest);
+        return EmitToStream(module, tm, kind, buffered);
+    }
+
+    bool ok = EmitToStream(module, tm, kind, dest);
+    dest.flush();
+    return ok;
+}
+
+bool EmitToBuffer(llvm::Module &module, llvm::TargetMachine &tm, EmitKind kind,
+                  llvm::SmallVectorImpl<char> &buffer) {
+    llvm::raw_svector_ostream dest(buffer);
+    return EmitToStream(module, tm, kind, dest);
+}
+
+// Parallel code generation splits a module into one partition per this
+// many instructions, and at most kMaxPartitions. The partitions depend on
+// the module alone, not on the number of threads.
+const size_t kPartitionSize = 2000;
+const size_t kMaxPartitions = 64;
+
+static size_t NumPartitions(const llvm::Module &module) {
+    size_t size = 0;
+    for (auto &f : module)
+        size += f.getInstructionCount();
+    return max<size_t>(1, min(size / kPartitionSize, kMaxPartitions));
+}
+
+static bool IsEmpty(const llvm::Module &module) {
+    for (auto &gv : module.global_values())
+        if (!gv.isDeclaration())
+            return false;
+    return true;
+}
+
+bool EmitArchive(unique_ptr<llvm::Module> module, const string &path,
+                 const BackendOptions &options, bool lto) {
+    if (path == "-") {
+        llvm::errs() << "an archive cannot be written to stdout, -j<n> needs an output file\n";
+        return false;
+    }
+
+    // The partitions go through bitcode, each is code generated in a
+    // context of its own. Empty partitions are left out.
+    vector<llvm::SmallString<0>> partitions;
+    size_t num_partitions = NumPartitions(*module);
+    llvm::SplitModule(move(module), num_partitions, [&](unique_ptr<llvm::Module> part) {
+        if (IsEmpty(*part))
+            return;
+        partitions.emplace_back();
+        llvm::raw_svector_ostream os(partitions.back());
+        llvm::WriteBitcodeToFile(*part, os);
+    }, !lto);
+
+    // A pool of options.jobs threads with a TargetMachine each, taking the
+    // partitions in turn.
+    vector<llvm::SmallString<0>> objects(partitions.size());
+    atomic<size_t> next_partition{0};
+    atomic<bool> ok{true};
+    auto work = [&]() {
+        auto tm = CreateTargetMachine(options);
+        if (!tm) {
+            ok = false;
+            return;
+        }
+        for (size_t i = next_partition++; i < partitions.size(); i = next_partition++) {
+            llvm::LLVMContext context;
+            auto part = llvm::parseBitcodeFile(llvm::MemoryBufferRef(partitions[i], "part"), context);
+            if (!part) {
+                llvm::errs() << "fail to read partition " << i << ": " << llvm::toString(part.takeError()) << "\n";
+                ok = false;
+                continue;
+            }
+            if (!EmitToBuffer(**part, *tm, kEmitObject, objects[i]))
+                ok = false;
+        }
+    };
+    vector<thread> threads;
+    for (unsigned i = 0; i < options.jobs && i < partitions.size(); ++i)
+        threads.push_back(thread(work));
+    for (auto &t : threads)
+        t.join();
+    if (!ok)
+        return false;
+
+    vector<string> names;
+    for (unsigned i = 0; i != objects.size(); ++i)
+        names.push_back("part" + to_string(i) + ".o");
+
+    vector<llvm::NewArchiveMember> members;
+    for (unsigned i = 0; i != objects.size(); ++i)
+        members.push_back(llvm::NewArchiveMember(llvm::MemoryBufferRef(objects[i], names[i])));
+
+    if (auto err = llvm::writeArchive(path, members, true, llvm::object::Archive::K_GNU, true, false)) {
+        llvm::errs() << "fail to write archive " << path << ": " << llvm::toString(move(err)) << "\n";
+        return false;
+    }
+    return true;
+}
+
+bool LinkBitcodeFiles(const vector<string> &inputs, const string &output,
+                      const BackendOptions &options) {
+    auto merged = std::make_unique<llvm::Module>("yc lto", kState->the_context);
+    llvm::Linker linker(*merged);
+
+    for (auto &input : inputs) {
+        llvm::SMDiagnostic err;
+        auto module = llvm::parseIRFile(input, err, kState->the_context);
+        if (!module) {
+            err.print("yc", llvm::errs());
+            return false;
+        }
+        // resolves the extern declarations against the other inputs
+        if (linker.linkInModule(move(module))) {
+            llvm::errs() << "fail to link " << input << "\n";
+            return false;
+        }
+    }
+
+    auto tm = CreateTargetMachine(options);
+    if (!tm)
+        return false;
+    PrepareModule(*merged, *tm);
+
+    if (!options.exports.empty()) {
+        auto &exports = options.exports;
+        llvm::internalizeModule(*merged, [&](const llvm::GlobalValue &gv) {
+            return find(exports.begin(), exports.end(), gv.getName()) != exports.end();
+        });
+    }
+
+    OptimizeModule(*merged, *tm, options, true);
+
+    if (options.jobs > 0 && options.emit == kEmitObject)
+        return EmitArchive(move(merged), output, options, true);
+    return EmitFile(*merged, *tm, options.emit, output);
+}
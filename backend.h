@@ -0,0 +1,89 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <string>
+#include <memory>
+#include <vector>
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/Target/TargetMachine.h"
+
+// --emit=obj|asm|llvm-ir|bc
+enum EmitKind {
+    kEmitObject,
+    kEmitAssembly,
+    kEmitLlvmIr,
+    kEmitBitcode
+};
+
+// --fast-isel or --global-isel, else the target picks the instruction
+// selector for the opt level
+enum IselKind {
+    kIselDefault,
+    kIselFast,
+    kIselGlobal
+};
+
+struct BackendOptions {
+    // -O<n>, mid-level optimization; 0 runs no IR passes unless profiling
+    unsigned opt_level = 0;
+    // -j<n>, threads generating an object, which is then written as an
+    // archive whatever n is; 0 without -j, one thread and a plain object
+    unsigned jobs = 0;
+    EmitKind emit = kEmitObject;
+    IselKind isel = kIselDefault;
+    // symbols kept external by --link, everything else is internalized;
+    // empty means internalize nothing
+    std::vector<std::string> exports;
+    // --profile-generate[=<file>], instrument with InstrProf counters; the
+    // raw profile goes to <file>, or default.profraw if empty
+    bool profile_generate = false;
+    std::string profile_generate_path;
+    // --profile-use=<file>, merged .profdata from llvm-profdata
+    std::string profile_use_path;
+    // -ffast-math and the finer -f flags, for every function without a
+    // #pragma fp of its own
+    llvm::FastMathFlags fast_math;
+    // -fveclib=<lib>, vector variants of math functions the loop vectorizer
+    // may call; the library must be linked in, or loaded for the JIT
+    llvm::TargetLibraryInfoImpl::VectorLibrary vector_library = llvm::TargetLibraryInfoImpl::NoLibrary;
+};
+
+// Initialize all targets and create a TargetMachine for the host. The
+// code generator runs at the -O<n> of options, -O0 with the fast register
+// allocator and without any machine optimization.
+std::unique_ptr<llvm::TargetMachine> CreateTargetMachine(const BackendOptions &options);
+
+// Set the triple and data layout of the target machine on module.
+void PrepareModule(llvm::Module &module, llvm::TargetMachine &tm);
+
+// Run the standard -O<n> pipeline, plus the link time IPO passes if lto.
+// Profile instrumentation or annotation is part of this pipeline, so the
+// same -O<n> must be used for --profile-generate and --profile-use.
+void OptimizeModule(llvm::Module &module, llvm::TargetMachine &tm,
+                    const BackendOptions &options, bool lto);
+
+// Write module as kind to path, "-" is stdout.
+bool EmitFile(llvm::Module &module, llvm::TargetMachine &tm, EmitKind kind, const std::string &path);
+
+// Emit module as kind into buffer, e.g. an object for the JIT to load.
+bool EmitToBuffer(llvm::Module &module, llvm::TargetMachine &tm, EmitKind kind,
+                  llvm::SmallVectorImpl<char> &buffer);
+
+// Code generate module as objects on options.jobs threads, each with a
+// TargetMachine of its own, and write them to path as an archive. The
+// archive is the same for any number of threads. Unless lto, local
+// symbols stay local to the archive member that defines them. path cannot
+// be "-", archives are not written to stdout.
+bool EmitArchive(std::unique_ptr<llvm::Module> module, const std::string &path,
+                 const BackendOptions &options, bool lto);
+
+// Merge the bitcode files written by --lto into one module, optimize it as
+// a whole program and emit it as options.emit. With -j<n> an object is
+// written as an archive, see EmitArchive.
+bool LinkBitcodeFiles(const std::vector<std::string> &inputs, const std::string &output,
+                      const BackendOptions &options);
+
+#endif
@@ -0,0 +1,51 @@
+#include "builtins.h"
+#include "compiler_state.h"
+#include <cmath>
+#include <llvm-9/llvm/ADT/StringMap.h>
+
+using namespace std;
+
+static const Builtin kBuiltins[] = {
+    {"sqrt", llvm::Intrinsic::sqrt, 1, [](const double *a) { return sqrt(a[0]); }},
+    {"sin", llvm::Intrinsic::sin, 1, [](const double *a) { return sin(a[0]); }},
+    {"cos", llvm::Intrinsic::cos, 1, [](const double *a) { return cos(a[0]); }},
+    {"exp", llvm::Intrinsic::exp, 1, [](const double *a) { return exp(a[0]); }},
+    {"exp2", llvm::Intrinsic::exp2, 1, [](const double *a) { return exp2(a[0]); }},
+    {"log", llvm::Intrinsic::log, 1, [](const double *a) { return log(a[0]); }},
+    {"log2", llvm::Intrinsic::log2, 1, [](const double *a) { return log2(a[0]); }},
+    {"log10", llvm::Intrinsic::log10, 1, [](const double *a) { return log10(a[0]); }},
+    {"pow", llvm::Intrinsic::pow, 2, [](const double *a) { return pow(a[0], a[1]); }},
+    {"fabs", llvm::Intrinsic::fabs, 1, [](const double *a) { return fabs(a[0]); }},
+    {"floor", llvm::Intrinsic::floor, 1, [](const double *a) { return floor(a[0]); }},
+    {"ceil", llvm::Intrinsic::ceil, 1, [](const double *a) { return ceil(a[0]); }},
+    {"trunc", llvm::Intrinsic::trunc, 1, [](const double *a) { return trunc(a[0]); }},
+    {"round", llvm::Intrinsic::round, 1, [](const double *a) { return round(a[0]); }},
+    {"fma", llvm::Intrinsic::fma, 3, [](const double *a) { return fma(a[0], a[1], a[2]); }},
+    {"fmin", llvm::Intrinsic::minnum, 2, [](const double *a) { return fmin(a[0], a[1]); }},
+    {"fmax", llvm::Intrinsic::maxnum, 2, [](const double *a) { return fmax(a[0], a[1]); }},
+    {"copysign", llvm::Intrinsic::copysign, 2, [](const double *a) { return copysign(a[0], a[1]); }},
+};
+
+static llvm::StringMap<const Builtin *> BuildBuiltinMap() {
+    llvm::StringMap<const Builtin *> builtins;
+    for (const Builtin &b : kBuiltins)
+        builtins[b.name] = &b;
+    return builtins;
+}
+
+// Called for every call node by the resolver and the code generator, a
+// hash lookup and no allocation.
+const Builtin *GetBuiltin(llvm::StringRef name) {
+    static const llvm::StringMap<const Builtin *> kBuiltinMap = BuildBuiltinMap();
+    auto bi = kBuiltinMap.find(name);
+    if (bi == kBuiltinMap.end())
+        return nullptr;
+    const Builtin *builtin = bi->second;
+
+    // "extern sqrt(x);" is the C library function, the builtin is the same
+    auto fi = kState->function_protos.find(name);
+    if (fi == kState->function_protos.end())
+        return builtin;
+    const Prototype &proto = fi->second;
+    return proto.is_extern && proto.args.size() == builtin->arity ? builtin : nullptr;
+}
@@ -0,0 +1,24 @@
+#ifndef BUILTINS_H
+#define BUILTINS_H
+
+#include <llvm-9/llvm/ADT/StringRef.h>
+#include <llvm-9/llvm/IR/Intrinsics.h>
+
+/// Builtin - a function of the C math library that can be called without
+/// an extern. It is generated as an LLVM intrinsic rather than an opaque
+/// call, so the optimizer folds it, vectorizes loops calling it and lowers
+/// it to an instruction where the target has one.
+struct Builtin {
+    const char *name;
+    llvm::Intrinsic::ID id;
+    unsigned arity;
+    // the C library function on the host, to fold constant arguments
+    double (*fold)(const double *args);
+};
+
+// The builtin a call to name refers to, or nullptr. A function of the same
+// name defined in any module replaces the builtin, an extern with the
+// arity of the builtin does not.
+const Builtin *GetBuiltin(llvm::StringRef name);
+
+#endif
@@ -0,0 +1,676 @@
+#include "codegen.h"
+#include "tools.h"
+#include "builtins.h"
+#include "compiler_state.h"
+#include <algorithm>
+#include <vector>
+#include <llvm-9/llvm/IR/Verifier.h>
+#include <llvm-9/llvm/Support/ErrorHandling.h>
+
+thread_local CompilerState *kState = nullptr;
+
+
+using namespace llvm;
+
+// Variables are SSA values of kState->ssa, or allocas with ssa_codegen off.
+// Globals live in memory, the value of a scalar constant is used directly.
+Value *CodeGenerator::ReadVariable(uint32_t slot, StringRef name) {
+    if (slot == kGlobalSlot) {
+        const GlobalDecl &decl = kState->globals[name.str()];
+        if (decl.is_const)
+            return ConstantFP::get(kState->the_context, APFloat(decl.values[0]));
+        GlobalVariable *global = GetGlobal(name.str());
+        return kState->builder.CreateLoad(global, name);
+    }
+    if (kState->ssa_codegen)
+        return kState->ssa.ReadVariable(ssa_vars_[slot], kState->builder.GetInsertBlock());
+    AllocaInst *alloca = allocas_[slot];
+    return kState->builder.CreateLoad(alloca, name);
+}
+
+void CodeGenerator::WriteVariable(uint32_t slot, StringRef name, Value *val) {
+    if (slot == kGlobalSlot)
+        kState->builder.CreateStore(val, GetGlobal(name.str()));
+    else if (kState->ssa_codegen)
+        kState->ssa.WriteVariable(ssa_vars_[slot], kState->builder.GetInsertBlock(), val);
+    else
+        kState->builder.CreateStore(val, allocas_[slot]);
+}
+
+// A new variable in slot holding val, the slot of a variable of an inner
+// scope is not shared with any other.
+void CodeGenerator::DeclareVariable(uint32_t slot, StringRef name, Value *val) {
+    if (kState->ssa_codegen) {
+        ssa_vars_[slot] = kState->ssa.NewVariable(val->getType(), name.str());
+        kState->ssa.WriteVariable(ssa_vars_[slot], kState->builder.GetInsertBlock(), val);
+        return;
+    }
+
+    Function *the_function = kState->builder.GetInsertBlock()->getParent();
+    allocas_[slot] = CreateEntryBlockAlloca(the_function, name.str());
+    kState->builder.CreateStore(val, allocas_[slot]);
+}
+
+// The operators with a truth value, generated by EmitCondition.
+static bool IsCondition(const AstNode &node) {
+    if (node.kind == kNodeUnary)
+        return true;
+    if (node.kind != kNodeBinary)
+        return false;
+    switch (node.op) {
+    case '<':
+    case '>':
+    case kOpLessEqual:
+    case kOpGreaterEqual:
+    case kOpEqual:
+    case kOpNotEqual:
+    case kOpAnd:
+    case kOpOr:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool CodeGenerator::IsSpeculatable(NodeId id, unsigned &budget) const {
+    if (budget == 0)
+        return false;
+    --budget;
+
+    const AstNode &node = ast_.node(id);
+    switch (node.kind) {
+    case kNodeNumber:
+    case kNodeVariable:
+        return true;
+    case kNodeIndex:
+        // only constant indexes are known to be in bounds
+        return ast_.kind(node.b) == kNodeNumber;
+    case kNodeUnary:
+        return IsSpeculatable(node.a, budget);
+    case kNodeBinary:
+        return node.op != '=' && IsSpeculatable(node.a, budget) && IsSpeculatable(node.b, budget);
+    case kNodeCall: {
+        // other calls may have side effects or not return
+        if (!GetBuiltin(ast_.name(node.a)))
+            return false;
+        for (NodeId arg : ast_.list(node.b)) {
+            if (!IsSpeculatable(arg, budget))
+                return false;
+        }
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+Value *CodeGenerator::EmitExpr(NodeId id) {
+    const AstNode &node = ast_.node(id);
+    if (IsCondition(node))
+        return kState->builder.CreateUIToFP(EmitCondition(id), Type::getDoubleTy(kState->the_context),
+                                            "booltmp");
+
+    switch (node.kind) {
+    case kNodeNumber:
+        return ConstantFP::get(kState->the_context, APFloat(ast_.number(id)));
+    case kNodeVariable:
+        return ReadVariable(resolution_.slot(id), ast_.name(node.a));
+    case kNodeBinary:
+        return EmitBinary(id);
+    case kNodeCall:
+        return EmitCall(id);
+    case kNodeIndex:
+        return EmitIndex(id);
+    default:
+        llvm_unreachable("not an expression");
+    }
+}
+
+// Relational operators are unordered, true if an operand is NaN, as '<'
+// always was. A double is true if it is neither 0 nor NaN.
+Value *CodeGenerator::EmitCondition(NodeId id) {
+    const AstNode &node = ast_.node(id);
+    IRBuilder<> &builder = kState->builder;
+    if (!IsCondition(node))
+        return builder.CreateFCmpONE(EmitExpr(id), ConstantFP::get(kState->the_context, APFloat(0.0)),
+                                     "tobool");
+    if (node.kind == kNodeUnary)
+        return builder.CreateNot(EmitCondition(node.a), "nottmp");
+    if (node.op == kOpAnd || node.op == kOpOr)
+        return EmitLogical(id);
+
+    Value *l = EmitExpr(node.a);
+    Value *r = EmitExpr(node.b);
+    switch (node.op) {
+    case '<':
+        return builder.CreateFCmpULT(l, r, "cmptmp");
+    case '>':
+        return builder.CreateFCmpUGT(l, r, "cmptmp");
+    case kOpLessEqual:
+        return builder.CreateFCmpULE(l, r, "cmptmp");
+    case kOpGreaterEqual:
+        return builder.CreateFCmpUGE(l, r, "cmptmp");
+    case kOpEqual:
+        return builder.CreateFCmpOEQ(l, r, "cmptmp");
+    case kOpNotEqual:
+        return builder.CreateFCmpUNE(l, r, "cmptmp");
+    default:
+        llvm_unreachable("not a comparison");
+    }
+}
+
+// && and || short-circuit. A right operand that is cheap and free of side
+// effects is evaluated anyway, an and/or of i1 is cheaper than a branch.
+Value *CodeGenerator::EmitLogical(NodeId id) {
+    const AstNode &node = ast_.node(id);
+    IRBuilder<> &builder = kState->builder;
+    bool is_and = node.op == kOpAnd;
+
+    Value *l = EmitCondition(node.a);
+    unsigned budget = kSpeculationLimit;
+    if (IsSpeculatable(node.b, budget)) {
+        Value *r = EmitCondition(node.b);
+        return is_and ? builder.CreateAnd(l, r, "andtmp") : builder.CreateOr(l, r, "ortmp");
+    }
+
+    Function *the_function = builder.GetInsertBlock()->getParent();
+    BasicBlock *lhs_bb = builder.GetInsertBlock();
+    BasicBlock *rhs_bb = BasicBlock::Create(kState->the_context, is_and ? "and.rhs" : "or.rhs", the_function);
+    BasicBlock *merge_bb = BasicBlock::Create(kState->the_context, is_and ? "and.end" : "or.end");
+
+    if (is_and)
+        builder.CreateCondBr(l, rhs_bb, merge_bb);
+    else
+        builder.CreateCondBr(l, merge_bb, rhs_bb);
+    kState->ssa.SealBlock(rhs_bb);
+
+    builder.SetInsertPoint(rhs_bb);
+    Value *r = EmitCondition(node.b);
+    // the right operand may have ended in another block
+    rhs_bb = builder.GetInsertBlock();
+    builder.CreateBr(merge_bb);
+
+    the_function->getBasicBlockList().push_back(merge_bb);
+    builder.SetInsertPoint(merge_bb);
+    kState->ssa.SealBlock(merge_bb);
+    PHINode *phi = builder.CreatePHI(Type::getInt1Ty(kState->the_context), 2, is_and ? "andtmp" : "ortmp");
+    phi->addIncoming(builder.getInt1(!is_and), lhs_bb);
+    phi->addIncoming(r, rhs_bb);
+    return phi;
+}
+
+Value *CodeGenerator::EmitBinary(NodeId id) {
+    const AstNode &node = ast_.node(id);
+
+    // Special case for '=' because the LHS is a variable
+    // rather than an expression.
+    if (node.op == '=') {
+        Value *val = EmitExpr(node.b);
+        WriteVariable(resolution_.slot(node.a), ast_.name(ast_.node(node.a).a), val);
+        return val;
+    }
+
+    Value *l = EmitExpr(node.a);
+    Value *r = EmitExpr(node.b);
+
+    switch (node.op) {
+    case '+':
+        return kState->builder.CreateFAdd(l, r, "addtmp");
+    case '-':
+        return kState->builder.CreateFSub(l, r, "subtmp");
+    case '*':
+        return kState->builder.CreateFMul(l, r, "multmp");
+    case '/':
+        return kState->builder.CreateFDiv(l, r, "divtmp");
+    default:
+        llvm_unreachable("invalid binary operator");
+    }
+}
+
+Value *CodeGenerator::EmitCall(NodeId id) {
+    const AstNode &node = ast_.node(id);
+    std::vector<Value *> args_v;
+    for (NodeId arg : ast_.list(node.b))
+        args_v.push_back(EmitExpr(arg));
+
+    // The intrinsic of a builtin takes the fast-math flags of the builder.
+    if (const Builtin *builtin = GetBuiltin(ast_.name(node.a))) {
+        Function *intrinsic = Intrinsic::getDeclaration(kState->the_module.get(), builtin->id,
+                                                        {Type::getDoubleTy(kState->the_context)});
+        return kState->builder.CreateCall(intrinsic, args_v, "calltmp");
+    }
+
+    Function *callee_f = GetFunction(ast_.name(node.a).str());
+
+    // Small helpers are cloned for constant arguments and inlined once the
+    // caller is complete, see EmitFunction.
+    callee_f = SpecializeCall(callee_f, args_v);
+    CallInst *call = kState->builder.CreateCall(callee_f, args_v, "calltmp");
+    if (ShouldInline(callee_f))
+        call->addAttribute(AttributeList::FunctionIndex, Attribute::AlwaysInline);
+    return call;
+}
+
+Value *CodeGenerator::EmitIndex(NodeId id) {
+    const AstNode &node = ast_.node(id);
+    std::string name = ast_.name(node.a).str();
+    const GlobalDecl &decl = kState->globals[name];
+
+    Value *index = EmitExpr(node.b);
+    if (auto *c = dyn_cast<ConstantFP>(index)) {
+        double at = c->getValueAPF().convertToDouble();
+        if (decl.is_const && at >= 0 && at < decl.size)
+            return ConstantFP::get(kState->the_context, APFloat(decl.values[uint32_t(at)]));
+    }
+
+    // out of bounds is undefined, only constant indexes are checked
+    index = kState->builder.CreateFPToSI(index, kState->builder.getInt64Ty(), "idx");
+    Value *indexes[] = {kState->builder.getInt64(0), index};
+    GlobalVariable *array = GetGlobal(name);
+    Value *elem = kState->builder.CreateInBoundsGEP(array->getValueType(), array, indexes, "elem");
+    return kState->builder.CreateLoad(elem, name);
+}
+
+void CodeGenerator::EmitStat(NodeId id) {
+    const AstNode &node = ast_.node(id);
+    switch (node.kind) {
+    case kNodeAssignment:
+        WriteVariable(resolution_.slot(id), ast_.name(node.a), EmitExpr(node.b));
+        break;
+    case kNodeReturn:
+        kState->builder.CreateRet(EmitExpr(node.a));
+        break;
+    case kNodeIf:
+        EmitIf(id);
+        break;
+    case kNodeWhile:
+        EmitWhile(id);
+        break;
+    case kNodeCompound:
+        EmitCompound(id);
+        break;
+    default:
+        EmitExpr(id);
+        break;
+    }
+}
+
+// if (c) { x = a; } else { y = b; }, where each branch is empty or assigns
+// a value of at most kSpeculationLimit nodes without side effects to a
+// local, is
+//   x = c ? a : x; y = c ? y : b;
+// without a branch. Both values are computed before either is assigned.
+bool CodeGenerator::EmitIfAsSelect(NodeId id) {
+    const AstNode &node = ast_.node(id);
+    NodeId branches[2] = {node.b, node.c};
+    NodeId assignments[2] = {kNoNode, kNoNode};
+    for (int i = 0; i < 2; ++i) {
+        const AstNode &branch = ast_.node(branches[i]);
+        ArrayRef<uint32_t> stats = ast_.list(branch.b);
+        if (!ast_.list(branch.a).empty() || stats.size() > 1)
+            return false;
+        if (stats.empty())
+            continue;
+
+        unsigned budget = kSpeculationLimit;
+        if (ast_.kind(stats[0]) != kNodeAssignment || resolution_.slot(stats[0]) == kGlobalSlot ||
+            !IsSpeculatable(ast_.node(stats[0]).b, budget))
+            return false;
+        assignments[i] = stats[0];
+    }
+    if (assignments[0] == kNoNode && assignments[1] == kNoNode)
+        return false;
+
+    IRBuilder<> &builder = kState->builder;
+    Value *cond_v = EmitCondition(node.a);
+    Value *vals[2] = {nullptr, nullptr};
+    for (int i = 0; i < 2; ++i)
+        if (assignments[i] != kNoNode)
+            vals[i] = EmitExpr(ast_.node(assignments[i]).b);
+
+    for (int i = 0; i < 2; ++i) {
+        if (assignments[i] == kNoNode)
+            continue;
+        uint32_t slot = resolution_.slot(assignments[i]);
+        StringRef name = ast_.name(ast_.node(assignments[i]).a);
+        if (i == 0 && assignments[1] != kNoNode && resolution_.slot(assignments[1]) == slot) {
+            WriteVariable(slot, name, builder.CreateSelect(cond_v, vals[0], vals[1], name));
+            break;
+        }
+        Value *old = ReadVariable(slot, name);
+        WriteVariable(slot, name, i == 0 ? builder.CreateSelect(cond_v, vals[0], old, name)
+                                         : builder.CreateSelect(cond_v, old, vals[1], name));
+    }
+    return true;
+}
+
+void CodeGenerator::EmitIf(NodeId id) {
+    if (EmitIfAsSelect(id))
+        return;
+
+    const AstNode &node = ast_.node(id);
+    Value *cond_v = EmitCondition(node.a);
+
+    Function *the_function = kState->builder.GetInsertBlock()->getParent();
+
+    // Create blocks for the then and else cases.  Insert the 'then' block at the
+    // end of the function.
+    BasicBlock *then_bb = BasicBlock::Create(kState->the_context, "then", the_function);
+    BasicBlock *else_bb = BasicBlock::Create(kState->the_context, "else");
+    BasicBlock *merge_bb = BasicBlock::Create(kState->the_context, "ifcont");
+
+    kState->builder.CreateCondBr(cond_v, then_bb, else_bb);
+    kState->ssa.SealBlock(then_bb);
+    kState->ssa.SealBlock(else_bb);
+
+    // Emit then value.
+    kState->builder.SetInsertPoint(then_bb);
+    EmitStat(node.b);
+    kState->builder.CreateBr(merge_bb);
+
+    // Emit else value.
+    the_function->getBasicBlockList().push_back(else_bb);
+    kState->builder.SetInsertPoint(else_bb);
+    EmitStat(node.c);
+    kState->builder.CreateBr(merge_bb);
+
+    // emit merge block.
+    the_function->getBasicBlockList().push_back(merge_bb);
+    kState->builder.SetInsertPoint(merge_bb);
+    kState->ssa.SealBlock(merge_bb);
+    // nop
+    kState->builder.CreateFAdd(
+            ConstantFP::get(kState->the_context, APFloat(0.0)),
+            ConstantFP::get(kState->the_context, APFloat(0.0)),
+            "nop");
+}
+
+// The !llvm.loop node of a loop latch, carrying the hints of the loop.
+static MDNode *CreateLoopId(const LoopHints &hints) {
+    LLVMContext &context = kState->the_context;
+    auto hint = [&](const char *name, Constant *val) {
+        Metadata *ops[] = {MDString::get(context, name), ConstantAsMetadata::get(val)};
+        return MDNode::get(context, ops);
+    };
+
+    // the first operand refers to the node itself
+    auto temp = MDNode::getTemporary(context, None);
+    SmallVector<Metadata *, 4> ops = {temp.get()};
+    if (hints.unroll == 1)
+        ops.push_back(MDNode::get(context, MDString::get(context, "llvm.loop.unroll.disable")));
+    else if (hints.unroll > 1)
+        ops.push_back(hint("llvm.loop.unroll.count", kState->builder.getInt32(hints.unroll)));
+    if (hints.vectorize_width > 1)
+        ops.push_back(hint("llvm.loop.vectorize.enable", kState->builder.getTrue()));
+    if (hints.vectorize_width > 0)
+        ops.push_back(hint("llvm.loop.vectorize.width", kState->builder.getInt32(hints.vectorize_width)));
+    if (hints.interleave > 0)
+        ops.push_back(hint("llvm.loop.interleave.count", kState->builder.getInt32(hints.interleave)));
+
+    MDNode *loop_id = MDNode::getDistinct(context, ops);
+    loop_id->replaceOperandWith(0, loop_id);
+    return loop_id;
+}
+
+void CodeGenerator::EmitWhile(NodeId id) {
+    // Rotated into
+    //   if (cond) { do body while (cond); }
+    // the guard branches around the preheader, the latch holds the loop id.
+    const AstNode &node = ast_.node(id);
+    Function *the_function = kState->builder.GetInsertBlock()->getParent();
+
+    Value *cond_v = EmitCondition(node.a);
+
+    BasicBlock *preheader_bb = BasicBlock::Create(kState->the_context, "loop.ph", the_function);
+    BasicBlock *loop_bb = BasicBlock::Create(kState->the_context, "loop");
+    BasicBlock *after_bb = BasicBlock::Create(kState->the_context, "afterloop");
+
+    kState->builder.CreateCondBr(cond_v, preheader_bb, after_bb);
+    kState->ssa.SealBlock(preheader_bb);
+
+    kState->builder.SetInsertPoint(preheader_bb);
+    kState->builder.CreateBr(loop_bb);
+
+    the_function->getBasicBlockList().push_back(loop_bb);
+    kState->builder.SetInsertPoint(loop_bb);
+    EmitStat(node.b);
+
+    // back edge, the body may have ended in another block
+    if (kState->tiered_jit)
+        EmitTierCount();
+    cond_v = EmitCondition(node.a);
+    BranchInst *latch = kState->builder.CreateCondBr(cond_v, loop_bb, after_bb);
+    latch->setMetadata(LLVMContext::MD_loop, CreateLoopId(ast_.hints(id)));
+    // the back edge was the last predecessor of the loop header
+    kState->ssa.SealBlock(loop_bb);
+    kState->ssa.SealBlock(after_bb);
+
+    the_function->getBasicBlockList().push_back(after_bb);
+    kState->builder.SetInsertPoint(after_bb);
+}
+
+void CodeGenerator::EmitCompound(NodeId id) {
+    const AstNode &node = ast_.node(id);
+
+    // Declare all variables and emit their initializer, the list holds
+    // (name, initializer) pairs and the variables take consecutive slots.
+    ArrayRef<uint32_t> vars = ast_.list(node.a);
+    uint32_t slot = resolution_.slot(id);
+    for (size_t i = 0; i + 1 < vars.size(); i += 2) {
+        NodeId init = vars[i + 1];
+
+        Value *init_val;
+        if (init != kNoNode) {
+            init_val = EmitExpr(init);
+        } else {
+            // if there is no initializer, set to 0
+            init_val = ConstantFP::get(kState->the_context, APFloat(0.0));
+        }
+
+        DeclareVariable(slot++, ast_.name(vars[i]), init_val);
+    }
+
+    for (NodeId stat : ast_.list(node.b))
+        EmitStat(stat);
+}
+
+Function *EmitPrototype(const Prototype &proto) {
+    std::vector<Type *> doubles(proto.args.size(), Type::getDoubleTy(kState->the_context));
+
+    FunctionType *ft = FunctionType::get(Type::getDoubleTy(kState->the_context), doubles, false);
+
+    Function *f = Function::Create(ft, Function::ExternalLinkage, proto.name, kState->the_module.get());
+
+    // Set names for all arguments.
+    unsigned idx = 0;
+    for (auto &arg : f->args())
+        arg.setName(proto.args[idx++]);
+
+    return f;
+}
+
+// The initializer of global, zeros after the values given.
+static Constant *GetInitializer(const GlobalDecl &global) {
+    Type *double_ty = Type::getDoubleTy(kState->the_context);
+    if (!global.size)
+        return ConstantFP::get(double_ty, global.values[0]);
+
+    std::vector<Constant *> elems;
+    for (double val : global.values)
+        elems.push_back(ConstantFP::get(double_ty, val));
+    return ConstantArray::get(ArrayType::get(double_ty, global.size), elems);
+}
+
+GlobalVariable *EmitGlobalDeclaration(const GlobalDecl &global) {
+    Type *ty = Type::getDoubleTy(kState->the_context);
+    if (global.size)
+        ty = ArrayType::get(ty, global.size);
+
+    // Constants are defined elsewhere but their values are known here,
+    // available_externally lets them fold without emitting a second copy.
+    if (!global.is_const)
+        return new GlobalVariable(*kState->the_module, ty, false, GlobalValue::ExternalLinkage,
+                                  nullptr, global.name);
+    auto *gv = new GlobalVariable(*kState->the_module, ty, true, GlobalValue::AvailableExternallyLinkage,
+                                  GetInitializer(global), global.name);
+    gv->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+    return gv;
+}
+
+static bool IsTrue(double val) {
+    return val < 0 || val > 0;
+}
+
+double CodeGenerator::FoldConstant(NodeId id) {
+    const AstNode &node = ast_.node(id);
+    switch (node.kind) {
+    case kNodeNumber:
+        return ast_.number(id);
+    case kNodeVariable:
+        return kState->globals[ast_.name(node.a).str()].values[0];
+    case kNodeUnary:
+        return !IsTrue(FoldConstant(node.a));
+    case kNodeCall: {
+        std::vector<double> args;
+        for (NodeId arg : ast_.list(node.b))
+            args.push_back(FoldConstant(arg));
+        return GetBuiltin(ast_.name(node.a))->fold(args.data());
+    }
+    case kNodeBinary: {
+        double l = FoldConstant(node.a);
+        double r = FoldConstant(node.b);
+        // as generated by EmitBinary and EmitCondition
+        switch (node.op) {
+        case '+':
+            return l + r;
+        case '-':
+            return l - r;
+        case '*':
+            return l * r;
+        case '/':
+            return l / r;
+        case '<':
+            return !(l >= r);
+        case '>':
+            return !(l <= r);
+        case kOpLessEqual:
+            return !(l > r);
+        case kOpGreaterEqual:
+            return !(l < r);
+        case kOpEqual:
+            return l == r;
+        case kOpNotEqual:
+            return l != r;
+        case kOpAnd:
+            return IsTrue(l) && IsTrue(r);
+        case kOpOr:
+            return IsTrue(l) || IsTrue(r);
+        default:
+            llvm_unreachable("invalid binary operator");
+        }
+    }
+    default:
+        llvm_unreachable("not a constant expression");
+    }
+}
+
+GlobalDecl CodeGenerator::FoldGlobal(NodeId id) {
+    const AstNode &node = ast_.node(id);
+    GlobalDecl global;
+    global.name = ast_.name(node.a).str();
+    global.is_const = node.flags & kGlobalConst;
+    global.size = node.c;
+    for (NodeId item : ast_.list(node.b))
+        global.values.push_back(FoldConstant(item));
+    global.values.resize(std::max<uint32_t>(global.size, 1), 0.0);
+    return global;
+}
+
+GlobalVariable *CodeGenerator::EmitGlobal(NodeId id) {
+    GlobalDecl global = FoldGlobal(id);
+    std::string name = global.name;
+    kState->globals[name] = std::move(global);
+
+    // The only definition, constants are read-only data. Later modules,
+    // and the JIT, refer to this one.
+    GlobalVariable *gv = GetGlobal(name);
+    gv->setLinkage(GlobalValue::ExternalLinkage);
+    gv->setInitializer(GetInitializer(kState->globals[name]));
+    return gv;
+}
+
+Function *CodeGenerator::EmitExtern(NodeId id) {
+    Prototype proto = ast_.GetPrototype(id);
+    std::string name = proto.name;
+    auto fi = kState->function_protos.find(name);
+    proto.is_extern = fi == kState->function_protos.end() || fi->second.is_extern;
+    kState->function_protos[name] = std::move(proto);
+    return GetFunction(name);
+}
+
+// The fast-math flags of a #pragma fp.
+static FastMathFlags GetFastMathFlags(uint16_t fp_flags) {
+    FastMathFlags fmf;
+    fmf.setAllowReassoc(fp_flags & kFpReassoc);
+    fmf.setNoNaNs(fp_flags & kFpNoNaNs);
+    fmf.setNoInfs(fp_flags & kFpNoInfs);
+    fmf.setNoSignedZeros(fp_flags & kFpNoSignedZeros);
+    fmf.setAllowReciprocal(fp_flags & kFpAllowReciprocal);
+    fmf.setAllowContract(fp_flags & kFpContract);
+    fmf.setApproxFunc(fp_flags & kFpApproxFunc);
+    return fmf;
+}
+
+// The attributes the code generator takes the floating point options of f
+// from, in place of its TargetOptions.
+static void SetFastMathAttributes(Function *f, FastMathFlags fmf) {
+    auto set = [f](const char *kind, bool on) { f->addFnAttr(kind, on ? "true" : "false"); };
+    set("unsafe-fp-math", fmf.isFast());
+    set("no-nans-fp-math", fmf.noNaNs());
+    set("no-infs-fp-math", fmf.noInfs());
+    set("no-signed-zeros-fp-math", fmf.noSignedZeros());
+}
+
+Function *CodeGenerator::EmitFunction(NodeId id) {
+    const AstNode &node = ast_.node(id);
+
+    // Declared by a previous "extern" or call, or declared now.
+    Prototype proto = ast_.GetPrototype(id);
+    std::string name = proto.name;
+    kState->function_protos[name] = std::move(proto);
+    Function *the_function = GetFunction(name);
+
+    // Every floating point operation of the body gets the flags.
+    bool fp_override = node.flags & kFpOverride;
+    FastMathFlags fmf = fp_override ? GetFastMathFlags(node.flags) : kState->fast_math;
+    kState->builder.setFastMathFlags(fmf);
+    if (fmf.any() || fp_override)
+        SetFastMathAttributes(the_function, fmf);
+
+    // Create a new basic block to start insertion into.
+    BasicBlock *bb  = BasicBlock::Create(kState->the_context, "entry", the_function);
+    kState->builder.SetInsertPoint(bb);
+    kState->ssa.Reset();
+    kState->ssa.SealBlock(bb);
+
+    // The arguments are the first slots.
+    ssa_vars_.assign(resolution_.num_slots(id), 0);
+    allocas_.assign(resolution_.num_slots(id), nullptr);
+    uint32_t slot = 0;
+    for (auto &arg : the_function->args())
+        DeclareVariable(slot++, arg.getName(), &arg);
+
+    if (kState->tiered_jit)
+        EmitTierCount();
+
+    EmitStat(node.b);
+    kState->builder.clearFastMathFlags();
+    InlineSmallCalls(the_function);
+
+    // Validate the generated code, checking for consistency.
+    if (kVerifyIr)
+        verifyFunction(*the_function, &errs());
+
+    YC_TRACE("generated code for " + name);
+    return the_function;
+}
@@ -0,0 +1,71 @@
+#ifndef CODEGEN_H
+#define CODEGEN_H
+
+#include <vector>
+#include "abstract_syntax_tree.h"
+#include "resolver.h"
+#include <llvm-9/llvm/IR/Function.h>
+#include <llvm-9/llvm/IR/GlobalVariable.h>
+#include <llvm-9/llvm/IR/Instructions.h>
+#include <llvm-9/llvm/IR/Value.h>
+
+// Operands of && and || and the values of an if lowered to a select are
+// evaluated without a branch if they are free of side effects and of at
+// most this many nodes.
+const unsigned kSpeculationLimit = 8;
+
+/// CodeGenerator - generates the IR of the nodes of an Ast into the module
+/// of kState, with a switch over the kind of each node. The nodes must have
+/// been resolved without errors, see Resolver, so nothing is checked here.
+class CodeGenerator {
+private:
+    const Ast &ast_;
+    const Resolution &resolution_;
+    // the variable of each slot of the function, in kState->ssa or as an
+    // alloca with ssa_codegen off
+    std::vector<unsigned> ssa_vars_;
+    std::vector<llvm::AllocaInst *> allocas_;
+
+    llvm::Value *ReadVariable(uint32_t slot, llvm::StringRef name);
+    void WriteVariable(uint32_t slot, llvm::StringRef name, llvm::Value *val);
+    void DeclareVariable(uint32_t slot, llvm::StringRef name, llvm::Value *val);
+
+    // Whether id can be evaluated where it may not be, see kSpeculationLimit.
+    bool IsSpeculatable(NodeId id, unsigned &budget) const;
+
+    llvm::Value *EmitExpr(NodeId id);
+    // id as an i1, comparisons and logical operators without going
+    // through a double
+    llvm::Value *EmitCondition(NodeId id);
+    llvm::Value *EmitLogical(NodeId id);
+    llvm::Value *EmitBinary(NodeId id);
+    llvm::Value *EmitCall(NodeId id);
+    llvm::Value *EmitIndex(NodeId id);
+    double FoldConstant(NodeId id);
+    void EmitStat(NodeId id);
+    void EmitIf(NodeId id);
+    bool EmitIfAsSelect(NodeId id);
+    void EmitWhile(NodeId id);
+    void EmitCompound(NodeId id);
+public:
+    CodeGenerator(const Ast &ast, const Resolution &resolution)
+        : ast_(ast), resolution_(resolution) {}
+
+    // Generate a kNodeFunction. Its prototype goes into function_protos, so
+    // later modules can declare it.
+    llvm::Function *EmitFunction(NodeId id);
+    // Declare a kNodePrototype, also remembered in function_protos.
+    llvm::Function *EmitExtern(NodeId id);
+    // Define a kNodeGlobal, its initializers folded into kState->globals.
+    llvm::GlobalVariable *EmitGlobal(NodeId id);
+    // The GlobalDecl of a kNodeGlobal.
+    GlobalDecl FoldGlobal(NodeId id);
+};
+
+// Declare proto in the module of kState.
+llvm::Function *EmitPrototype(const Prototype &proto);
+// Declare global in the module of kState. A constant is declared with its
+// values, so loads from it fold in every module that uses it.
+llvm::GlobalVariable *EmitGlobalDeclaration(const GlobalDecl &global);
+
+#endif
@@ -0,0 +1,107 @@
+#include "compiler_session.h"
+#include "parser.h"
+#include "tools.h"
+#include <llvm-9/llvm/Support/MemoryBuffer.h>
+
+using namespace std;
+
+CompilerSession::CompilerSession(const BackendOptions &options)
+    : options_(options) {
+    state_.diags.set_output(&diagnostics_);
+    state_.fast_math = options.fast_math;
+}
+
+CompilerSession::~CompilerSession() {
+    // The JIT and the module may still refer to the state while destroyed.
+    CompilerStateScope scope(&state_);
+    // diagnostics_ goes first
+    state_.diags.Flush();
+    state_.tiered_jit.reset();
+    state_.the_jit.reset();
+    state_.the_module.reset();
+}
+
+bool CompilerSession::AddSource(llvm::StringRef source, llvm::StringRef name) {
+    CompilerStateScope scope(&state_);
+    unsigned num_errors = state_.diags.num_errors();
+
+    // source is only read while parsing, no copy is needed
+    Parser p(llvm::MemoryBuffer::getMemBuffer(source, name, false));
+    p.MainLoop();
+
+    return state_.diags.num_errors() == num_errors;
+}
+
+bool CompilerSession::Emit(EmitKind kind, llvm::SmallVectorImpl<char> &buffer) {
+    CompilerStateScope scope(&state_);
+    if (!state_.the_module)
+        return false;
+
+    if (!target_machine_)
+        target_machine_ = CreateTargetMachine(options_);
+    if (!target_machine_)
+        return false;
+
+    PrepareModule(*state_.the_module, *target_machine_);
+    OptimizeModule(*state_.the_module, *target_machine_, options_, false);
+    return EmitToBuffer(*state_.the_module, *target_machine_, kind, buffer);
+}
+
+void CompilerSession::EnableTiering(uint64_t threshold) {
+    CompilerStateScope scope(&state_);
+    InitializeNativeTargetOnce();
+    if (!state_.the_jit)
+        state_.the_jit = std::make_unique<llvm::orc::KaleidoscopeJIT>();
+    state_.tiered_jit = std::make_unique<TieredJit>(*state_.the_jit, threshold);
+}
+
+bool CompilerSession::AddToJit() {
+    CompilerStateScope scope(&state_);
+    if (!state_.the_module)
+        return false;
+
+    if (!state_.the_jit)
+        state_.the_jit = std::make_unique<llvm::orc::KaleidoscopeJIT>();
+    // dropped as a whole, as a batch of RunTopLevelExprs
+    if (!AllSymbolsDefined(*state_.the_module, nullptr)) {
+        state_.the_module.reset();
+        return false;
+    }
+
+    auto &tm = state_.the_jit->getTargetMachine();
+    PrepareModule(*state_.the_module, tm);
+    if (state_.tiered_jit) {
+        state_.tiered_jit->AddModule(move(state_.the_module));
+        return true;
+    }
+    OptimizeModule(*state_.the_module, tm, options_, false);
+    state_.the_jit->addModule(move(state_.the_module));
+    return true;
+}
+
+bool CompilerSession::Evaluate(vector<double> &results) {
+    CompilerStateScope scope(&state_);
+    return RunTopLevelExprs(results);
+}
+
+uint64_t CompilerSession::Lookup(const string &name) {
+    CompilerStateScope scope(&state_);
+    if (!state_.the_jit)
+        return 0;
+
+    auto symbol = state_.the_jit->findSymbol(name);
+    if (!symbol)
+        return 0;
+
+    auto address = symbol.getAddress();
+    if (!address) {
+        state_.diags.Error(llvm::toString(address.takeError()));
+        return 0;
+    }
+    return *address;
+}
+
+string CompilerSession::diagnostics() {
+    state_.diags.Flush();
+    return diagnostics_.str();
+}
@@ -0,0 +1,63 @@
+#ifndef COMPILER_SESSION_H
+#define COMPILER_SESSION_H
+
+#include <string>
+#include <memory>
+#include <sstream>
+#include <vector>
+#include <cstdint>
+#include <llvm-9/llvm/ADT/SmallVector.h>
+#include <llvm-9/llvm/ADT/StringRef.h>
+#include "compiler_state.h"
+#include "backend.h"
+
+/// CompilerSession - compiles sources held in memory, in process.
+///
+/// Each session owns its CompilerState, so any number of sessions can be
+/// used from different threads at the same time. One session must only be
+/// used by one thread at a time.
+class CompilerSession {
+private:
+    CompilerState state_;
+    BackendOptions options_;
+    std::unique_ptr<llvm::TargetMachine> target_machine_;
+    std::ostringstream diagnostics_;
+public:
+    CompilerSession(const BackendOptions &options = BackendOptions());
+    ~CompilerSession();
+
+    // Parse source and generate code for it into the current module.
+    // Returns false if any error was reported.
+    bool AddSource(llvm::StringRef source, llvm::StringRef name = "<source>");
+
+    // Optimize the current module with the session options and emit it.
+    bool Emit(EmitKind kind, llvm::SmallVectorImpl<char> &buffer);
+
+    // Run definitions added from now on as -O0 code first and recompile
+    // the hot ones at -O3 in the background, see TieredJit. Sources added
+    // from then on are for AddToJit and Evaluate only, not for Emit.
+    void EnableTiering(uint64_t threshold = kDefaultTierUpThreshold);
+
+    // Also generate a <name>_map batch entry point for each definition, see
+    // CreateMapEntryPoint in tools.h.
+    void set_map_entry_points(bool enable) { state_.map_entry_points = enable; }
+
+    // Hand the current module to the session JIT, optimized for the host
+    // CPU at the -O<n> of the session options. Later sources go into a new
+    // module and can still call the functions added before. A module that
+    // uses an undefined symbol is reported and dropped, false is returned.
+    bool AddToJit();
+
+    // JIT the sources added since the last call and run their top-level
+    // expressions in order, appending one result per expression. The
+    // expressions of all those sources are compiled as one module.
+    bool Evaluate(std::vector<double> &results);
+
+    // Address of a JIT compiled symbol, 0 if it is not defined.
+    uint64_t Lookup(const std::string &name);
+
+    // Everything LogError reported in this session.
+    std::string diagnostics();
+};
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef COMPILER_STATE_H
+#define COMPILER_STATE_H
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <llvm-9/llvm/IR/IRBuilder.h>
+#include <llvm-9/llvm/IR/Instructions.h>
+#include <llvm-9/llvm/IR/LegacyPassManager.h>
+#include <llvm-9/llvm/IR/LLVMContext.h>
+#include <llvm-9/llvm/IR/Module.h>
+#include "abstract_syntax_tree.h"
+#include "KaleidoscopeJIT.h"
+#include "tiered_jit.h"
+#include "ssa_builder.h"
+#include "diagnostics.h"
+
+/// CompilerState - the LLVM objects and symbol tables of one compilation.
+/// Code generation works on the state bound to the current thread, so
+/// separate states can be used from separate threads at the same time.
+struct CompilerState {
+    llvm::LLVMContext the_context;
+    llvm::IRBuilder<> builder;
+    std::unique_ptr<llvm::Module> the_module;
+    // With ssa_codegen every variable of the function being generated is a
+    // variable of ssa, built straight into phis, otherwise an alloca.
+    SsaBuilder ssa;
+    bool ssa_codegen = true;
+    std::unique_ptr<llvm::legacy::FunctionPassManager> the_fpm;
+    std::unique_ptr<llvm::orc::KaleidoscopeJIT> the_jit;
+    // if set, definitions are generated with tier counters and go into the
+    // JIT through it
+    std::unique_ptr<TieredJit> tiered_jit;
+    // less<> finds a StringRef without copying it, see GetBuiltin
+    std::map<std::string, Prototype, std::less<>> function_protos;
+    // the globals declared so far, by name
+    std::map<std::string, GlobalDecl> globals;
+
+    // Top-level expressions are compiled into expr_module as the functions
+    // anon_exprs, in source order, until RunTopLevelExprs runs them.
+    std::unique_ptr<llvm::Module> expr_module;
+    std::vector<std::string> anon_exprs;
+    unsigned num_anon_exprs = 0;
+
+    // specialize and inline small callees while generating calls, see
+    // SpecializeCall and InlineSmallCalls
+    bool inline_calls = true;
+
+    // also generate <name>_map for every definition, see CreateMapEntryPoint
+    bool map_entry_points = false;
+
+    // the fast-math flags of the floating point operations of a definition
+    // without a #pragma fp
+    llvm::FastMathFlags fast_math;
+
+    // where LogError reports to
+    DiagnosticEngine diags;
+
+    CompilerState() : builder(the_context) {}
+};
+
+// the state of the current thread
+extern thread_local CompilerState *kState;
+
+/// CompilerStateScope - binds a state to the current thread for its lifetime.
+class CompilerStateScope {
+private:
+    CompilerState *saved_;
+public:
+    CompilerStateScope(CompilerState *state) : saved_(kState) { kState = state; }
+    ~CompilerStateScope() { kState = saved_; }
+};
+
+#endif
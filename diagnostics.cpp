@@ -0,0 +1,100 @@
+#include "diagnostics.h"
+
+using namespace std;
+
+void DiagnosticEngine::SetSource(llvm::StringRef file_name, llvm::StringRef source) {
+    file_name_ = file_name.str();
+    source_ = source;
+    source_errors_ = 0;
+    has_location_ = false;
+    line_start_ = 0;
+    line_ = 1;
+}
+
+void DiagnosticEngine::ClearSource() {
+    file_name_.clear();
+    source_ = llvm::StringRef();
+    source_errors_ = 0;
+    has_location_ = false;
+}
+
+void DiagnosticEngine::FindLocation(unsigned offset, unsigned &line, unsigned &column) {
+    // back from the start if the error lies before the previous one
+    if (offset < line_start_) {
+        line_start_ = 0;
+        line_ = 1;
+    }
+
+    while (true) {
+        size_t newline = source_.find('\n', line_start_);
+        if (newline == llvm::StringRef::npos || newline >= offset)
+            break;
+        line_start_ = newline + 1;
+        ++line_;
+    }
+    line = line_;
+    column = offset - line_start_ + 1;
+}
+
+void DiagnosticEngine::Report(DiagLevel level, const llvm::Twine &message) {
+    static const char *const kLevelNames[] = {"trace", "note", "warning", "error"};
+
+    switch (level) {
+    case kDiagTrace:
+        if (!trace_)
+            return;
+        break;
+    case kDiagNote:
+        if (error_limit_ && source_errors_ > error_limit_)
+            return;
+        break;
+    case kDiagWarning:
+        ++num_warnings_;
+        break;
+    case kDiagError:
+        ++num_errors_;
+        ++source_errors_;
+        if (error_limit_ && source_errors_ > error_limit_)
+            return;
+        break;
+    }
+
+    if (!file_name_.empty()) {
+        buffer_ += file_name_;
+        buffer_ += ':';
+        if (has_location_ && !source_.empty() && offset_ <= source_.size()) {
+            unsigned line, column;
+            FindLocation(offset_, line, column);
+            buffer_ += to_string(line) + ':' + to_string(column) + ':';
+        }
+        buffer_ += ' ';
+    }
+    buffer_ += kLevelNames[level];
+    buffer_ += ": ";
+    message.toVector(scratch_);
+    buffer_.append(scratch_.data(), scratch_.size());
+    scratch_.clear();
+    buffer_ += '\n';
+
+    if (level == kDiagError && error_limit_ && source_errors_ == error_limit_)
+        buffer_ += "too many errors emitted, stopping now\n";
+
+    if (buffer_.size() >= kDiagnosticBufferSize)
+        Flush();
+}
+
+void DiagnosticEngine::Append(llvm::StringRef formatted, unsigned errors, unsigned warnings) {
+    num_errors_ += errors;
+    num_warnings_ += warnings;
+    buffer_ += formatted;
+    if (buffer_.size() >= kDiagnosticBufferSize)
+        Flush();
+}
+
+void DiagnosticEngine::Flush() {
+    if (buffer_.empty())
+        return;
+    out_->write(buffer_.data(), buffer_.size());
+    out_->flush();
+    buffer_.clear();
+}
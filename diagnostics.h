@@ -0,0 +1,103 @@
+#ifndef DIAGNOSTICS_H
+#define DIAGNOSTICS_H
+
+#include <string>
+#include <iostream>
+#include <llvm-9/llvm/ADT/SmallString.h>
+#include <llvm-9/llvm/ADT/StringRef.h>
+#include <llvm-9/llvm/ADT/Twine.h>
+
+// errors reported before giving up on a source, like clang -ferror-limit
+const unsigned kDefaultErrorLimit = 20;
+// diagnostics collected before they are written out
+const size_t kDiagnosticBufferSize = 16 << 10;
+
+enum DiagLevel {
+    kDiagTrace,
+    kDiagNote,
+    kDiagWarning,
+    kDiagError
+};
+
+/// DiagnosticEngine - formats diagnostics as "<file>:<line>:<col>: error: ..."
+/// and writes them out in blocks, not one flush per message. Trace messages
+/// are compiler debugging output, only kept with set_trace.
+///
+/// The location is the offset last set in the source last set, the parser
+/// moves it along with each token. Line and column are found by scanning
+/// forward from the previous location, so a source with errors in order is
+/// scanned once however many errors it has.
+class DiagnosticEngine {
+private:
+    std::ostream *out_ = &std::cerr;
+    std::string buffer_;
+    llvm::SmallString<128> scratch_;
+    unsigned num_errors_ = 0;
+    unsigned num_warnings_ = 0;
+    // errors since SetSource, the limit is per source
+    unsigned source_errors_ = 0;
+    unsigned error_limit_ = kDefaultErrorLimit;
+    bool trace_ = false;
+
+    std::string file_name_;
+    llvm::StringRef source_;
+    bool has_location_ = false;
+    unsigned offset_ = 0;
+    // start and number of the line of the previous location
+    size_t line_start_ = 0;
+    unsigned line_ = 1;
+
+    void FindLocation(unsigned offset, unsigned &line, unsigned &column);
+public:
+    ~DiagnosticEngine() { Flush(); }
+
+    // Where Flush writes to.
+    void set_output(std::ostream *out) { out_ = out; }
+    // 0 for no limit
+    void set_error_limit(unsigned limit) { error_limit_ = limit; }
+    unsigned error_limit() const { return error_limit_; }
+    void set_trace(bool trace) { trace_ = trace; }
+    bool trace() const { return trace_; }
+
+    // Locate the following errors in source, which must stay alive until
+    // ClearSource. Without a source errors have no location.
+    void SetSource(llvm::StringRef file_name, llvm::StringRef source);
+    void ClearSource();
+    void set_location(unsigned offset) { has_location_ = true; offset_ = offset; }
+    void clear_location() { has_location_ = false; }
+
+    // Report message at the current location. Past the error limit of the
+    // source errors are only counted, and the notes that go with them
+    // dropped.
+    void Report(DiagLevel level, const llvm::Twine &message);
+    void Error(const llvm::Twine &message) { Report(kDiagError, message); }
+    void Warning(const llvm::Twine &message) { Report(kDiagWarning, message); }
+    void Note(const llvm::Twine &message) { Report(kDiagNote, message); }
+    void Trace(const llvm::Twine &message) { Report(kDiagTrace, message); }
+
+    // Add diagnostics another engine formatted, e.g. on a worker thread,
+    // with the errors and warnings among them.
+    void Append(llvm::StringRef formatted, unsigned errors, unsigned warnings);
+
+    unsigned num_errors() const { return num_errors_; }
+    unsigned num_warnings() const { return num_warnings_; }
+    // Reached the error limit, callers should stop.
+    bool TooManyErrors() const { return error_limit_ && source_errors_ >= error_limit_; }
+
+    void Flush();
+};
+
+// YC_TRACE("parsed " + name) - trace the compiler with --trace. The message
+// is only built if tracing is on, and NDEBUG builds leave it out entirely.
+// Expects kState, see compiler_state.h.
+#ifdef NDEBUG
+#define YC_TRACE(message) do { } while (false)
+#else
+#define YC_TRACE(message)                         \
+    do {                                          \
+        if (kState->diags.trace())                \
+            kState->diags.Trace(message);         \
+    } while (false)
+#endif
+
+#endif
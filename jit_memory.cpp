@@ -0,0 +1,89 @@
+#include "jit_memory.h"
+#include "llvm/Support/Process.h"
+
+using namespace std;
+
+ArenaMemoryMapper::ArenaMemoryMapper(size_t arena_size) {
+    page_size_ = llvm::sys::Process::getPageSizeEstimate();
+    arena_size = (arena_size + page_size_ - 1) / page_size_ * page_size_;
+
+    error_code ec;
+    arena_ = llvm::sys::Memory::allocateMappedMemory(
+        arena_size, nullptr, llvm::sys::Memory::MF_READ | llvm::sys::Memory::MF_WRITE, ec);
+    if (!ec && arena_.base())
+        free_[0] = arena_.allocatedSize();
+}
+
+ArenaMemoryMapper::~ArenaMemoryMapper() {
+    if (arena_.base())
+        llvm::sys::Memory::releaseMappedMemory(arena_);
+}
+
+llvm::sys::MemoryBlock ArenaMemoryMapper::allocateMappedMemory(
+        llvm::SectionMemoryManager::AllocationPurpose purpose, size_t num_bytes,
+        const llvm::sys::MemoryBlock *const near_block, unsigned flags, error_code &ec) {
+    size_t size = (num_bytes + page_size_ - 1) / page_size_ * page_size_;
+    lock_guard<mutex> lock(mutex_);
+
+    // first fit, the arena is small enough for a linear walk
+    for (auto it = free_.begin(); it != free_.end(); ++it) {
+        if (it->second < size)
+            continue;
+
+        size_t offset = it->first;
+        if (it->second > size)
+            free_[offset + size] = it->second - size;
+        free_.erase(it);
+
+        llvm::sys::MemoryBlock block(static_cast<char *>(arena_.base()) + offset, size);
+        ec = llvm::sys::Memory::protectMappedMemory(block, flags);
+        return block;
+    }
+
+    ec = make_error_code(errc::not_enough_memory);
+    return llvm::sys::MemoryBlock();
+}
+
+error_code ArenaMemoryMapper::protectMappedMemory(const llvm::sys::MemoryBlock &block, unsigned flags) {
+    return llvm::sys::Memory::protectMappedMemory(block, flags);
+}
+
+error_code ArenaMemoryMapper::releaseMappedMemory(llvm::sys::MemoryBlock &block) {
+    if (!block.base())
+        return error_code();
+
+    // Pages go back writable, like freshly mapped memory.
+    error_code ec = llvm::sys::Memory::protectMappedMemory(
+        block, llvm::sys::Memory::MF_READ | llvm::sys::Memory::MF_WRITE);
+
+    lock_guard<mutex> lock(mutex_);
+    size_t offset = static_cast<char *>(block.base()) - static_cast<char *>(arena_.base());
+    size_t size = block.allocatedSize();
+
+    // coalesce with the neighbouring free ranges
+    auto next = free_.lower_bound(offset);
+    if (next != free_.end() && offset + size == next->first) {
+        size += next->second;
+        next = free_.erase(next);
+    }
+    if (next != free_.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == offset) {
+            prev->second += size;
+            block = llvm::sys::MemoryBlock();
+            return ec;
+        }
+    }
+    free_[offset] = size;
+
+    block = llvm::sys::MemoryBlock();
+    return ec;
+}
+
+size_t ArenaMemoryMapper::free_bytes() {
+    lock_guard<mutex> lock(mutex_);
+    size_t bytes = 0;
+    for (auto &range : free_)
+        bytes += range.second;
+    return bytes;
+}
@@ -0,0 +1,40 @@
+#ifndef JIT_MEMORY_H
+#define JIT_MEMORY_H
+
+#include <map>
+#include <mutex>
+#include <cstdint>
+#include <system_error>
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/Support/Memory.h"
+
+// 64 MiB of code and data for all modules of one JIT
+const size_t kDefaultJitArenaSize = 64 << 20;
+
+/// ArenaMemoryMapper - hands out the pages of one region reserved up front
+/// to the SectionMemoryManagers of a JIT. Pages released when a module is
+/// removed are reused by later modules, and the JIT never maps more than
+/// the arena size.
+class ArenaMemoryMapper : public llvm::SectionMemoryManager::MemoryMapper {
+private:
+    llvm::sys::MemoryBlock arena_;
+    size_t page_size_;
+    // free page ranges, offset in the arena -> size
+    std::map<size_t, size_t> free_;
+    std::mutex mutex_;
+public:
+    ArenaMemoryMapper(size_t arena_size = kDefaultJitArenaSize);
+    ~ArenaMemoryMapper() override;
+
+    llvm::sys::MemoryBlock allocateMappedMemory(llvm::SectionMemoryManager::AllocationPurpose purpose,
+                                                size_t num_bytes,
+                                                const llvm::sys::MemoryBlock *const near_block,
+                                                unsigned flags, std::error_code &ec) override;
+    std::error_code protectMappedMemory(const llvm::sys::MemoryBlock &block, unsigned flags) override;
+    std::error_code releaseMappedMemory(llvm::sys::MemoryBlock &block) override;
+
+    // bytes not handed out at the moment
+    size_t free_bytes();
+};
+
+#endif
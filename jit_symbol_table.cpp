@@ -0,0 +1,67 @@
+#include "jit_symbol_table.h"
+#include <thread>
+
+using namespace std;
+
+JitSymbolTable::ReadGuard::ReadGuard(JitSymbolTable &table) : table_(table) {
+    // start at a slot of our own, so threads rarely compete for one
+    unsigned slot = hash<thread::id>()(this_thread::get_id()) % kMaxReaders;
+    while (true) {
+        for (unsigned i = 0; i != kMaxReaders; ++i, slot = (slot + 1) % kMaxReaders) {
+            // A stale epoch only delays reclamation. Everything is seq_cst, so
+            // a writer that misses this slot has already published its table.
+            uint64_t expected = 0;
+            if (table_.readers_[slot].epoch.compare_exchange_strong(expected, table_.epoch_.load())) {
+                slot_ = slot;
+                return;
+            }
+        }
+        this_thread::yield();
+    }
+}
+
+JitSymbolTable::ReadGuard::~ReadGuard() {
+    table_.readers_[slot_].epoch.store(0);
+}
+
+JitSymbolTable::JitSymbolTable() : symbols_(new SymbolMap()), epoch_(1) {}
+
+JitSymbolTable::~JitSymbolTable() {
+    // no readers are left by now
+    delete symbols_.load();
+    for (auto &item : retired_)
+        item.second();
+}
+
+llvm::JITTargetAddress JitSymbolTable::Lookup(llvm::StringRef name) {
+    ReadGuard guard(*this);
+    auto *symbols = symbols_.load();
+    auto it = symbols->find(name);
+    return it == symbols->end() ? 0 : it->second;
+}
+
+void JitSymbolTable::Publish(unique_ptr<SymbolMap> symbols) {
+    const SymbolMap *old_symbols = symbols_.exchange(symbols.release());
+    Retire([old_symbols]() { delete old_symbols; });
+}
+
+void JitSymbolTable::Retire(function<void()> reclaim) {
+    // Readers that enter from now on get a later epoch and cannot reach
+    // what was unpublished before.
+    retired_.push_back(make_pair(epoch_.fetch_add(1), move(reclaim)));
+}
+
+void JitSymbolTable::Reclaim() {
+    uint64_t oldest = UINT64_MAX;
+    for (auto &reader : readers_) {
+        uint64_t epoch = reader.epoch.load();
+        if (epoch != 0 && epoch < oldest)
+            oldest = epoch;
+    }
+
+    // retired_ is ordered by epoch
+    auto it = retired_.begin();
+    for (; it != retired_.end() && it->first < oldest; ++it)
+        it->second();
+    retired_.erase(retired_.begin(), it);
+}
@@ -0,0 +1,71 @@
+#ifndef JIT_SYMBOL_TABLE_H
+#define JIT_SYMBOL_TABLE_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/JITSymbol.h"
+
+/// JitSymbolTable - mangled name -> address of everything a JIT defines.
+///
+/// Lookups take no lock. The table itself is immutable, a writer builds a
+/// new one and publishes it with one atomic store. Replaced tables, and the
+/// code of removed modules, are retired and only reclaimed once no reader
+/// that could still see them is left (epoch based reclamation).
+///
+/// Publish, Retire and Reclaim must be serialized by the caller.
+class JitSymbolTable {
+public:
+    using SymbolMap = llvm::StringMap<llvm::JITTargetAddress>;
+
+    /// ReadGuard - while alive, nothing retired after the guard was created
+    /// is reclaimed. Hold one around calls into JIT code when modules can be
+    /// removed from another thread. Guards can nest.
+    class ReadGuard {
+    private:
+        JitSymbolTable &table_;
+        unsigned slot_;
+    public:
+        ReadGuard(JitSymbolTable &table);
+        ~ReadGuard();
+        ReadGuard(const ReadGuard &) = delete;
+        ReadGuard &operator=(const ReadGuard &) = delete;
+    };
+
+    JitSymbolTable();
+    ~JitSymbolTable();
+
+    // 0 if name is not defined
+    llvm::JITTargetAddress Lookup(llvm::StringRef name);
+
+    // Replace the table, the old one is retired.
+    void Publish(std::unique_ptr<SymbolMap> symbols);
+
+    // Run reclaim once no reader active now is left.
+    void Retire(std::function<void()> reclaim);
+
+    // Run what no reader can reach anymore.
+    void Reclaim();
+
+private:
+    // readers in a guard at the same time, more wait for a free slot
+    static const unsigned kMaxReaders = 64;
+
+    struct alignas(64) ReaderSlot {
+        // epoch the reader entered in, 0 if free
+        std::atomic<uint64_t> epoch{0};
+    };
+
+    std::atomic<const SymbolMap *> symbols_;
+    std::atomic<uint64_t> epoch_;
+    ReaderSlot readers_[kMaxReaders];
+    // retire epoch, reclaim
+    std::vector<std::pair<uint64_t, std::function<void()>>> retired_;
+};
+
+#endif
@@ -1,4 +1,6 @@
 #include "lexer.h"
+#include "compiler_state.h"
+#include <cstring>
 
 using namespace std;
 
@@ -7,36 +9,115 @@ using namespace std;
 //     // last_char_ = ' ';
 // }
 
-Lexer::Lexer() {}
+Lexer::Lexer() : start_ptr_(nullptr), cur_ptr_(nullptr), end_ptr_(nullptr), last_char_(' '), tok_offset_(0) {}
 
-Lexer::Lexer(string file_path) {
-    input_file_.open(file_path);
-    last_char_ = ' ';
+Lexer::Lexer(string file_path) : Lexer() {
+    SetFilePath(file_path);
 }
 
-Lexer::~Lexer() {
-    input_file_.close();
-}
+Lexer::~Lexer() {}
 
 void Lexer::SetFilePath(string file_path) {
-    input_file_.close();
-    input_file_.open(file_path);
+    // The whole source is mapped, the token cache checksums it.
+    auto buffer_or_err = llvm::MemoryBuffer::getFile(file_path, -1, false);
+    if (!buffer_or_err) {
+        SetSource(nullptr);
+        return;
+    }
+    SetSource(move(*buffer_or_err));
+}
+
+void Lexer::SetSource(unique_ptr<llvm::MemoryBuffer> source) {
+    cache_.reset();
+    cache_writer_.reset();
+    source_ = move(source);
+    start_ptr_ = cur_ptr_ = end_ptr_ = nullptr;
     last_char_ = ' ';
+
+    if (!source_)
+        return;
+    start_ptr_ = cur_ptr_ = source_->getBufferStart();
+    end_ptr_ = source_->getBufferEnd();
 }
 
 bool Lexer::IsFileOpen() {
-    return input_file_.is_open();
+    return source_ != nullptr;
+}
+
+bool Lexer::UseTokenCache(const string &cache_path) {
+    if (!source_)
+        return false;
+
+    cache_ = TokenCache::Open(cache_path, source_->getBuffer());
+    if (cache_) {
+        cache_pos_ = 0;
+        return true;
+    }
+
+    cache_writer_ = make_unique<TokenCacheWriter>();
+    cache_path_ = cache_path;
+    return false;
+}
+
+int Lexer::ReadChar() {
+    if (cur_ptr_ == end_ptr_)
+        return EOF;
+    return (unsigned char)*cur_ptr_++;
 }
 
 int Lexer::GetTok() {
+    if (cache_)
+        return ReplayTok();
+
+    int tok = LexTok();
+    if (cache_writer_) {
+        cache_writer_->AddToken(tok, tok_offset_, identifier_str_, num_val_);
+        if (tok == kTokEof) {
+            if (!cache_writer_->Write(cache_path_, source_->getBuffer()))
+                kState->diags.Warning("fail to write token cache " + cache_path_);
+            cache_writer_.reset();
+        }
+    }
+    return tok;
+}
+
+void Lexer::Rewind() {
+    if (cache_) {
+        cache_pos_ = 0;
+        return;
+    }
+    cur_ptr_ = start_ptr_;
+    last_char_ = ' ';
+    if (cache_writer_)
+        cache_writer_ = make_unique<TokenCacheWriter>();
+}
+
+int Lexer::ReplayTok() {
+    // Past the end keep returning the final kTokEof.
+    if (cache_pos_ == cache_->size())
+        return kTokEof;
+
+    const CachedToken &tok = cache_->token(cache_pos_++);
+    tok_offset_ = tok.offset;
+    if (tok.kind == kTokIdentifier)
+        cached_identifier_ = cache_->identifier(tok.operand);
+    else if (tok.kind == kTokNumber)
+        num_val_ = cache_->number(tok.operand);
+    return tok.kind;
+}
+
+int Lexer::LexTok() {
 
     // Skip any whitespace
     while (isspace(last_char_))
-        last_char_ = input_file_.get();
+        last_char_ = ReadChar();
+
+    // last_char_ has already been consumed
+    tok_offset_ = cur_ptr_ - start_ptr_ - (last_char_ != EOF);
 
     if (isalpha(last_char_)) {
         identifier_str_  = last_char_;
-        while (isalnum(last_char_ = input_file_.get()))
+        while (isalnum(last_char_ = ReadChar()))
             identifier_str_ += last_char_;
         
         if (identifier_str_ == "def")
@@ -55,6 +136,8 @@ int Lexer::GetTok() {
             return kTokInt;
         if (identifier_str_ == "return")
             return kTokReturn;
+        if (identifier_str_ == "const")
+            return kTokConst;
 
         return kTokIdentifier;
     }
@@ -63,7 +146,7 @@ int Lexer::GetTok() {
         string num_str;
         do {
             num_str += last_char_;
-            last_char_ = input_file_.get();
+            last_char_ = ReadChar();
         } while (isdigit(last_char_) || last_char_ == '.');
 
         num_val_ = strtod(num_str.c_str(), nullptr);
@@ -71,19 +154,38 @@ int Lexer::GetTok() {
     }
 
     if (last_char_ == '#') {
+        static const char kPragma[] = "pragma";
+        size_t len = sizeof(kPragma) - 1;
+        if (size_t(end_ptr_ - cur_ptr_) >= len && memcmp(cur_ptr_, kPragma, len) == 0 &&
+            (size_t(end_ptr_ - cur_ptr_) == len || !isalnum((unsigned char)cur_ptr_[len]))) {
+            cur_ptr_ += len;
+            last_char_ = ReadChar();
+            return kTokPragma;
+        }
+
         do
-            last_char_ = input_file_.get();
+            last_char_ = ReadChar();
         while (last_char_ != EOF && last_char_ != '\n' && last_char_ != '\r');
 
         if (last_char_ != EOF)
-            return GetTok();
+            return LexTok();
     }
 
     if (last_char_ == EOF)
         return kTokEof;
 
     int this_char = last_char_;
-    last_char_ = input_file_.get();
+    last_char_ = ReadChar();
+
+    static const struct { char first, second; int tok; } kTwoCharOps[] = {
+        {'<', '=', kTokLessEqual}, {'>', '=', kTokGreaterEqual}, {'=', '=', kTokEqual},
+        {'!', '=', kTokNotEqual},  {'&', '&', kTokAnd},          {'|', '|', kTokOr}};
+    for (auto &op : kTwoCharOps) {
+        if (this_char == op.first && last_char_ == op.second) {
+            last_char_ = ReadChar();
+            return op.tok;
+        }
+    }
 
     return this_char;
 }
@@ -92,7 +194,13 @@ double Lexer::num_val() {
     return num_val_;
 }
 
-string Lexer::identifier_str() {
+llvm::StringRef Lexer::identifier() const {
+    if (cache_)
+        return cached_identifier_;
     return identifier_str_;
 }
 
+unsigned Lexer::tok_offset() {
+    return tok_offset_;
+}
+
@@ -2,10 +2,12 @@
 #define LEXER_H
 
 #include <string>
-#include <fstream>
+#include <memory>
 #include <cctype>
 #include <iostream>
 #include <cstdlib>
+#include <llvm-9/llvm/Support/MemoryBuffer.h>
+#include "token_cache.h"
 
 // The lexer returns tokens [0-255] if it is an unknown character, otherwise one
 // of these for known things.
@@ -26,27 +28,69 @@ enum Token {
     kTokInt = -10,
     kTokDouble = -11,
     
-    kTokReturn = -12
+    kTokReturn = -12,
+
+    // "#pragma", any other '#' starts a comment
+    kTokPragma = -13,
+
+    kTokConst = -14,
+
+    // operators of two characters, the others are their character
+    kTokLessEqual = -15,
+    kTokGreaterEqual = -16,
+    kTokEqual = -17,
+    kTokNotEqual = -18,
+    kTokAnd = -19,
+    kTokOr = -20
 };
 
 class Lexer {
 private:
     std::string identifier_str_;
     double num_val_;
-    std::ifstream input_file_;
+    std::unique_ptr<llvm::MemoryBuffer> source_;
+    const char *start_ptr_;
+    const char *cur_ptr_;
+    const char *end_ptr_;
     int last_char_;
+    unsigned tok_offset_;
+
+    // token cache, replaying from cache_ or recording into cache_writer_
+    std::unique_ptr<TokenCache> cache_;
+    uint32_t cache_pos_;
+    llvm::StringRef cached_identifier_;
+    std::unique_ptr<TokenCacheWriter> cache_writer_;
+    std::string cache_path_;
+
+    int ReadChar();
+    int LexTok();
+    int ReplayTok();
 public:
     // 接收一个文件路径
     Lexer(std::string file_path);
     Lexer();
     ~Lexer();
     void SetFilePath(std::string file_path);
+    void SetSource(std::unique_ptr<llvm::MemoryBuffer> source);
     bool IsFileOpen();
     int  GetTok();
+    // Start over at the first token, e.g. after a pre-pass over the source.
+    // A token cache being recorded is started over as well.
+    void Rewind();
+
+    // Replay tokens from cache_path if it matches the source, otherwise
+    // record this run into it. Returns true if the cache was used.
+    bool UseTokenCache(const std::string &cache_path);
     
     /* getters */
+    // nullptr if no source could be opened
+    const llvm::MemoryBuffer *source() const { return source_.get(); }
     double num_val();
-    std::string identifier_str();
+    // The current identifier, without a copy: from the string table of the
+    // token cache when replaying, which outlives the parse, otherwise from
+    // the lexer, valid until the next token.
+    llvm::StringRef identifier() const;
+    unsigned tok_offset();
 };
 
 #endif
@@ -1,82 +1,303 @@
 #include <iostream>
 #include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <vector>
 #include "parser.h"
 #include "abstract_syntax_tree.h"
-#include "llvm/Support/FileSystem.h"
-#include "llvm/Support/Host.h"
+#include "ast_serializer.h"
+#include "backend.h"
+#include "parallel_lowering.h"
+#include "compiler_state.h"
+#include "tools.h"
+#include "llvm/Support/Timer.h"
 #include "llvm/Support/raw_ostream.h"
-#include "llvm/Support/TargetRegistry.h"
-#include "llvm/Support/TargetSelect.h"
-#include "llvm/Target/TargetMachine.h"
-#include "llvm/Target/TargetOptions.h"
-
-extern std::unique_ptr<llvm::Module> kTheModule;
 
 using namespace std;
 
 void usage() {
-    cout << "yc <source file> <target file>" << endl;
+    cout << "yc [options] <source file> <target file>" << endl;
+    cout << "yc --eval [options] <source file>" << endl;
+    cout << "yc --link [options] <bitcode file>... <target file>" << endl;
+    cout << "  a source file ending in .yca is loaded as a serialized AST" << endl;
+    cout << "  --token-cache            lex through <source file>.ytc, written on first use" << endl;
+    cout << "  --emit-ast=<file>        also write the serialized AST of the source" << endl;
+    cout << "  --emit-summary=<file>    also write the prototypes and globals this module" << endl;
+    cout << "                           defines" << endl;
+    cout << "  --import=<file>          make the functions and globals of a module summary" << endl;
+    cout << "                           usable" << endl;
+    cout << "  -O<n>                    optimization level, default 0 (2 for --link)" << endl;
+    cout << "  --emit=<kind>            write obj (default), asm, llvm-ir or bc, a target" << endl;
+    cout << "                           file of - writes to stdout" << endl;
+    cout << "  --fast-isel              select instructions with FastISel, for quick -O0 builds" << endl;
+    cout << "  --global-isel            select instructions with GlobalISel, falling back to" << endl;
+    cout << "                           SelectionDAG for functions it can't handle" << endl;
+    cout << "  --error-limit=<n>        stop parsing a source after n errors, default 20," << endl;
+    cout << "                           0 for no limit" << endl;
+    cout << "  --trace                  trace the compiler to stderr (not in NDEBUG builds)" << endl;
+    cout << "  --time-phases            report the time spent in each compilation phase" << endl;
+    cout << "  --front-end-threads=<n>  parse the whole source first, then resolve and generate" << endl;
+    cout << "                           its definitions on n threads (not with --eval)" << endl;
+    cout << "  -ffast-math              let floating point math ignore NaNs, infinities and" << endl;
+    cout << "                           signed zeros, reassociate and contract, as the finer" << endl;
+    cout << "                           flags below all together" << endl;
+    cout << "  -fassociative-math       reassociate, e.g. to vectorize reductions (reassoc)" << endl;
+    cout << "  -freciprocal-math        x / y may become x * (1 / y) (arcp)" << endl;
+    cout << "  -fno-honor-nans          assume no operand or result is NaN (nnan)" << endl;
+    cout << "  -fno-honor-infinities    assume no operand or result is infinite (ninf)" << endl;
+    cout << "  -fno-signed-zeros        ignore the sign of zeros (nsz)" << endl;
+    cout << "  -ffp-contract=fast|off   fuse a * b + c into one fma where the target has one" << endl;
+    cout << "                           (contract), #pragma fp(...) in front of a def" << endl;
+    cout << "                           replaces all of them for that definition" << endl;
+    cout << "  -fveclib=<lib>           vectorize loops calling sin, exp, pow, ... with the" << endl;
+    cout << "                           math functions of SVML, MASSV or Accelerate, which" << endl;
+    cout << "                           must be linked in; none (default) vectorizes only" << endl;
+    cout << "                           those the target has instructions for" << endl;
+    cout << "  --no-inline              do not inline or specialize small functions" << endl;
+    cout << "  --no-ssa                 keep variables in stack slots instead of building SSA" << endl;
+    cout << "                           form during code generation" << endl;
+    cout << "  --map                    also generate void <f>_map(double *out, const double *a," << endl;
+    cout << "                           ..., int64_t n) for each def f, vectorized from -O2" << endl;
+    cout << "  --print-ir               dump the IR of each function to stderr" << endl;
+    cout << "  --lto                    same as --emit=bc, the input of --link" << endl;
+    cout << "  --eval                   JIT the source and print the value of each top-level" << endl;
+    cout << "                           expression" << endl;
+    cout << "  --tiered[=<n>]           with --eval, run definitions as -O0 code first and" << endl;
+    cout << "                           recompile them at -O3 after n calls and loop" << endl;
+    cout << "                           iterations (default 10000)" << endl;
+    cout << "  --link                   merge bitcode files, optimize them as one program" << endl;
+    cout << "  --export=<symbol>        keep symbol external in --link, internalize the rest" << endl;
+    cout << "  -j<n>                    generate an object on n threads, also with --link; it" << endl;
+    cout << "                           is written as an archive of partitions, the same for" << endl;
+    cout << "                           any n, not to stdout" << endl;
+    cout << "  --profile-generate[=<file>]" << endl;
+    cout << "                           instrument for PGO, link the driver with the profile" << endl;
+    cout << "                           runtime (clang -fprofile-instr-generate)" << endl;
+    cout << "  --profile-use=<file>     optimize with a profile merged by llvm-profdata," << endl;
+    cout << "                           implies -O2, use the -O<n> of the instrumented build" << endl;
+}
+
+static bool StartsWith(const string &str, const string &prefix) {
+    return str.compare(0, prefix.size(), prefix) == 0;
 }
 
 int main(int argc, char **argv) {
+    CompilerState state;
+    CompilerStateScope scope(&state);
 
-    if (argc != 3) {
-        usage();
-        return 1;
+    bool use_token_cache = false;
+    bool print_ir = false, link = false, eval = false;
+    bool tiered = false;
+    bool time_phases = false;
+    unsigned front_end_threads = 1;
+    uint64_t tier_up_threshold = kDefaultTierUpThreshold;
+    bool has_opt_level = false;
+    BackendOptions backend_options;
+    string ast_path, summary_path;
+    vector<string> imports;
+    vector<string> files;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--token-cache") {
+            use_token_cache = true;
+        } else if (StartsWith(arg, "--emit-ast=")) {
+            ast_path = arg.substr(strlen("--emit-ast="));
+        } else if (StartsWith(arg, "--emit-summary=")) {
+            summary_path = arg.substr(strlen("--emit-summary="));
+        } else if (StartsWith(arg, "--import=")) {
+            imports.push_back(arg.substr(strlen("--import=")));
+        } else if (arg == "--emit=obj") {
+            backend_options.emit = kEmitObject;
+        } else if (arg == "--emit=asm") {
+            backend_options.emit = kEmitAssembly;
+        } else if (arg == "--emit=llvm-ir") {
+            backend_options.emit = kEmitLlvmIr;
+        } else if (arg == "--emit=bc" || arg == "--lto") {
+            backend_options.emit = kEmitBitcode;
+        } else if (arg == "--fast-isel") {
+            backend_options.isel = kIselFast;
+        } else if (arg == "--global-isel") {
+            backend_options.isel = kIselGlobal;
+        } else if (StartsWith(arg, "--error-limit=")) {
+            state.diags.set_error_limit(atoi(arg.c_str() + strlen("--error-limit=")));
+        } else if (arg == "--trace") {
+            state.diags.set_trace(true);
+        } else if (arg == "--time-phases") {
+            time_phases = true;
+        } else if (StartsWith(arg, "--front-end-threads=") && atoi(arg.c_str() + strlen("--front-end-threads=")) > 0) {
+            front_end_threads = atoi(arg.c_str() + strlen("--front-end-threads="));
+        } else if (arg == "-ffast-math") {
+            backend_options.fast_math.setFast();
+        } else if (arg == "-fassociative-math") {
+            backend_options.fast_math.setAllowReassoc();
+        } else if (arg == "-freciprocal-math") {
+            backend_options.fast_math.setAllowReciprocal();
+        } else if (arg == "-fno-honor-nans") {
+            backend_options.fast_math.setNoNaNs();
+        } else if (arg == "-fno-honor-infinities") {
+            backend_options.fast_math.setNoInfs();
+        } else if (arg == "-fno-signed-zeros") {
+            backend_options.fast_math.setNoSignedZeros();
+        } else if (arg == "-ffp-contract=fast" || arg == "-ffp-contract=off") {
+            backend_options.fast_math.setAllowContract(arg == "-ffp-contract=fast");
+        } else if (arg == "-fveclib=SVML") {
+            backend_options.vector_library = llvm::TargetLibraryInfoImpl::SVML;
+        } else if (arg == "-fveclib=MASSV") {
+            backend_options.vector_library = llvm::TargetLibraryInfoImpl::MASSV;
+        } else if (arg == "-fveclib=Accelerate") {
+            backend_options.vector_library = llvm::TargetLibraryInfoImpl::Accelerate;
+        } else if (arg == "-fveclib=none") {
+            backend_options.vector_library = llvm::TargetLibraryInfoImpl::NoLibrary;
+        } else if (arg == "--no-inline") {
+            state.inline_calls = false;
+        } else if (arg == "--no-ssa") {
+            state.ssa_codegen = false;
+        } else if (arg == "--map") {
+            state.map_entry_points = true;
+        } else if (arg == "--print-ir") {
+            print_ir = true;
+        } else if (arg == "--eval") {
+            eval = true;
+        } else if (arg == "--tiered") {
+            tiered = true;
+        } else if (StartsWith(arg, "--tiered=") && atoll(arg.c_str() + strlen("--tiered=")) > 0) {
+            tiered = true;
+            tier_up_threshold = atoll(arg.c_str() + strlen("--tiered="));
+        } else if (arg == "--link") {
+            link = true;
+        } else if (StartsWith(arg, "--export=")) {
+            backend_options.exports.push_back(arg.substr(strlen("--export=")));
+        } else if (StartsWith(arg, "-O") && arg.size() == 3 && arg[2] >= '0' && arg[2] <= '3') {
+            backend_options.opt_level = arg[2] - '0';
+            has_opt_level = true;
+        } else if (arg == "--profile-generate") {
+            backend_options.profile_generate = true;
+        } else if (StartsWith(arg, "--profile-generate=")) {
+            backend_options.profile_generate = true;
+            backend_options.profile_generate_path = arg.substr(strlen("--profile-generate="));
+        } else if (StartsWith(arg, "--profile-use=")) {
+            backend_options.profile_use_path = arg.substr(strlen("--profile-use="));
+        } else if (StartsWith(arg, "-j") && atoi(arg.c_str() + 2) > 0) {
+            backend_options.jobs = atoi(arg.c_str() + 2);
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            usage();
+            return 1;
+        } else {
+            files.push_back(arg);
+        }
     }
 
-    Parser p(argv[1]);
-    p.MainLoop();
+    state.fast_math = backend_options.fast_math;
 
-    // Initialize the target registry etc.
-    llvm::InitializeAllTargetInfos();
-    llvm::InitializeAllTargets();
-    llvm::InitializeAllTargetMCs();
-    llvm::InitializeAllAsmParsers();
-    llvm::InitializeAllAsmPrinters();
+    if (!backend_options.profile_use_path.empty() && !has_opt_level) {
+        backend_options.opt_level = 2;
+        has_opt_level = true;
+    }
 
-    auto target_triple = llvm::sys::getDefaultTargetTriple();
-    kTheModule->setTargetTriple(target_triple);
+    if (link) {
+        if (files.size() < 2) {
+            usage();
+            return 1;
+        }
+        if (!has_opt_level)
+            backend_options.opt_level = 2;
 
-    string error;
-    auto target = llvm::TargetRegistry::lookupTarget(target_triple, error);
+        vector<string> inputs(files.begin(), files.end() - 1);
+        if (!LinkBitcodeFiles(inputs, files.back(), backend_options))
+            return 1;
+        if (files.back() != "-")
+            llvm::outs() << "Wrote " << files.back() << "\n";
+        return 0;
+    }
 
-    if (!target) {
-        llvm::errs() << error;
+    if (files.size() != (eval ? 1 : 2)) {
+        usage();
         return 1;
     }
 
-    auto cpu = "generic";
-    auto features = "";
+    if (tiered && eval) {
+        // the counters are generated against the JIT, it has to exist first
+        InitializeNativeTargetOnce();
+        kState->the_jit = std::make_unique<llvm::orc::KaleidoscopeJIT>();
+        kState->tiered_jit = std::make_unique<TieredJit>(*kState->the_jit, tier_up_threshold);
+    }
 
-    llvm::TargetOptions opt;
-    auto rm = llvm::Optional<llvm::Reloc::Model>();
-    auto the_target_machine = 
-        target->createTargetMachine(target_triple, cpu, features, opt, rm);
+    // --time-phases, the group prints the timers to stderr when main returns
+    llvm::TimerGroup phase_timers("yc", "Compilation phases");
+    llvm::Timer front_end_timer("front-end", "Parse and generate IR", phase_timers);
+    llvm::Timer optimize_timer("optimize", "Optimize IR", phase_timers);
+    llvm::Timer emit_timer("emit", "Emit", phase_timers);
+    auto phase = [&](llvm::Timer &timer) { return time_phases ? &timer : nullptr; };
 
-    kTheModule->setDataLayout(the_target_machine->createDataLayout());
+    {
+        llvm::TimeRegion region(phase(front_end_timer));
+        for (auto &import : imports)
+            if (!ImportModuleSummary(import))
+                return 1;
 
-    auto filename = argv[2];
-    error_code ec;
-    llvm::raw_fd_ostream dest(filename, ec, llvm::sys::fs::OF_None);
+        if (llvm::StringRef(files[0]).endswith(".yca")) {
+            kState->the_module = std::make_unique<llvm::Module>("my awesome jit", kState->the_context);
+            if (!LoadAstFile(files[0]))
+                return 1;
+        } else {
+            bool parallel = front_end_threads > 1 && !eval;
+            Parser p(files[0], use_token_cache);
+            p.set_print_ir(print_ir);
+            p.set_deferred(parallel);
+            p.MainLoop();
+            if (parallel && !LowerParallel(p.ast(), p.source(), front_end_threads))
+                return 1;
 
-    if (ec) {
-        llvm::errs() << "Could not open file: " << ec.message();
-        return 1;
+            if (!ast_path.empty() && kState->diags.num_errors() == 0 &&
+                !WriteAstFile(p.ast(), ast_path, kAstFileMagic))
+                return 1;
+        }
     }
 
-    llvm::legacy::PassManager pass;
-    auto file_type = llvm::TargetMachine::CGFT_ObjectFile;
+    // A source with errors writes no output. --eval still runs what had
+    // none, but fails as well.
+    bool has_errors = kState->diags.num_errors() != 0;
+    if (has_errors && !eval)
+        return 1;
+
+    if (!summary_path.empty() && !has_errors && !WriteModuleSummary(summary_path))
+        return 1;
+
+    if (eval) {
+        vector<double> results;
+        bool ok = RunTopLevelExprs(results);
+        for (double result : results)
+            cout << "Evaluated to " << result << endl;
+        return ok && !has_errors ? 0 : 1;
+    }
+    if (!kState->anon_exprs.empty())
+        kState->diags.Warning("top-level expressions are only run with --eval");
 
-    if (the_target_machine->addPassesToEmitFile(pass, dest, nullptr, file_type)) {
-        llvm::errs() << "TheTargetMachine can't emit a file of this type";
+    auto the_target_machine = CreateTargetMachine(backend_options);
+    if (!the_target_machine)
         return 1;
+    PrepareModule(*kState->the_module, *the_target_machine);
+
+    {
+        llvm::TimeRegion region(phase(optimize_timer));
+        OptimizeModule(*kState->the_module, *the_target_machine, backend_options, false);
     }
 
-    pass.run(*kTheModule);
-    dest.flush();
+    auto filename = files[1];
+    {
+        llvm::TimeRegion region(phase(emit_timer));
+        bool ok;
+        if (backend_options.jobs > 0 && backend_options.emit == kEmitObject)
+            ok = EmitArchive(move(kState->the_module), filename, backend_options, false);
+        else
+            ok = EmitFile(*kState->the_module, *the_target_machine, backend_options.emit, filename);
+        if (!ok)
+            return 1;
+    }
 
-    llvm::outs() << "Wrote " << filename << "\n";
+    if (filename != "-")
+        llvm::outs() << "Wrote " << filename << "\n";
 
     return 0;
 }
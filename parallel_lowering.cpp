@@ -0,0 +1,187 @@
+#include "parallel_lowering.h"
+#include "codegen.h"
+#include "resolver.h"
+#include "tools.h"
+#include "compiler_state.h"
+#include <atomic>
+#include <map>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <llvm-9/llvm/ADT/SmallVector.h>
+#include <llvm-9/llvm/Bitcode/BitcodeReader.h>
+#include <llvm-9/llvm/Bitcode/BitcodeWriter.h>
+#include <llvm-9/llvm/Linker/Linker.h>
+#include <llvm-9/llvm/Support/raw_ostream.h>
+
+using namespace std;
+
+namespace {
+
+// The output of one chunk of definitions.
+struct LoweredChunk {
+    llvm::SmallVector<char, 0> bitcode;
+    string diagnostics;
+    unsigned num_errors = 0;
+    unsigned num_warnings = 0;
+};
+
+class ParallelLowering {
+private:
+    const Ast &ast_;
+    const llvm::MemoryBuffer *source_;
+    // the state the results go to
+    CompilerState &main_;
+    vector<NodeId> definitions_;
+    // the globals in source order, and how many of them precede each
+    // definition
+    vector<string> globals_;
+    vector<size_t> globals_before_;
+    vector<LoweredChunk> chunks_;
+    atomic<size_t> next_chunk_{0};
+
+    void CollectPrototypes();
+    void Work();
+public:
+    ParallelLowering(const Ast &ast, const llvm::MemoryBuffer *source)
+        : ast_(ast), source_(source), main_(*kState) {}
+
+    bool Run(unsigned num_threads);
+};
+
+}
+
+// Every prototype in function_protos before any body is resolved. The
+// checks Resolver does against the module are done here against the
+// whole source instead, the module of a chunk only holds part of it.
+// Globals are defined in the module of kState, in source order, and a
+// body only sees those declared before it, as without threads.
+void ParallelLowering::CollectPrototypes() {
+    map<string, size_t> arities;
+    map<string, bool> defined;
+    Resolution no_slots;
+    for (NodeId id : ast_.top_level()) {
+        if (ast_.kind(id) == kNodeGlobal) {
+            if (Resolver(ast_, no_slots).Resolve(id)) {
+                CodeGenerator(ast_, no_slots).EmitGlobal(id);
+                globals_.push_back(ast_.name(ast_.node(id).a).str());
+            }
+            continue;
+        }
+
+        Prototype proto = ast_.GetPrototype(id);
+        bool definition = ast_.kind(id) == kNodeFunction;
+        kState->diags.set_location(ast_.node(id).offset);
+
+        if (kState->globals.count(proto.name)) {
+            LogError("Function conflicts with a global of the same name");
+            continue;
+        }
+        auto arity = arities.insert(make_pair(proto.name, proto.args.size()));
+        if (definition && defined[proto.name]) {
+            LogError("Function cannot be redefined.");
+            continue;
+        }
+        if (arity.first->second != proto.args.size()) {
+            LogError("Function redeclared with a different number of arguments");
+            continue;
+        }
+
+        if (definition) {
+            defined[proto.name] = true;
+            kState->function_protos[proto.name] = move(proto);
+            definitions_.push_back(id);
+            globals_before_.push_back(globals_.size());
+        } else {
+            // declared in source order as without threads
+            CodeGenerator(ast_, no_slots).EmitExtern(id);
+        }
+    }
+}
+
+void ParallelLowering::Work() {
+    CompilerState state;
+    CompilerStateScope scope(&state);
+    state.function_protos = main_.function_protos;
+    state.ssa_codegen = main_.ssa_codegen;
+    state.inline_calls = main_.inline_calls;
+    state.map_entry_points = main_.map_entry_points;
+    state.fast_math = main_.fast_math;
+    state.diags.set_error_limit(main_.diags.error_limit());
+    state.diags.set_trace(main_.diags.trace());
+
+    ostringstream diagnostics;
+    state.diags.set_output(&diagnostics);
+    if (source_)
+        state.diags.SetSource(source_->getBufferIdentifier(), source_->getBuffer());
+
+    // A thread takes the chunks in source order, the globals visible to
+    // its definitions only grow.
+    size_t visible_globals = 0;
+    Resolution resolution;
+    while (true) {
+        size_t chunk = next_chunk_++;
+        if (chunk >= chunks_.size())
+            break;
+
+        state.the_module = std::make_unique<llvm::Module>("chunk " + to_string(chunk), state.the_context);
+        unsigned errors = state.diags.num_errors(), warnings = state.diags.num_warnings();
+        size_t end = min(definitions_.size(), (chunk + 1) * kLoweringChunkSize);
+        for (size_t i = chunk * kLoweringChunkSize; i != end; ++i) {
+            for (; visible_globals != globals_before_[i]; ++visible_globals) {
+                const string &name = globals_[visible_globals];
+                state.globals[name] = main_.globals[name];
+            }
+            if (!Resolver(ast_, resolution).Resolve(definitions_[i]))
+                continue;
+            llvm::Function *fn_ir = CodeGenerator(ast_, resolution).EmitFunction(definitions_[i]);
+            if (state.map_entry_points)
+                CreateMapEntryPoint(fn_ir);
+        }
+
+        LoweredChunk &lowered = chunks_[chunk];
+        llvm::raw_svector_ostream os(lowered.bitcode);
+        llvm::WriteBitcodeToFile(*state.the_module, os);
+
+        state.diags.Flush();
+        lowered.diagnostics = diagnostics.str();
+        lowered.num_errors = state.diags.num_errors() - errors;
+        lowered.num_warnings = state.diags.num_warnings() - warnings;
+        diagnostics.str("");
+    }
+    state.diags.ClearSource();
+}
+
+bool ParallelLowering::Run(unsigned num_threads) {
+    CollectPrototypes();
+    chunks_.resize((definitions_.size() + kLoweringChunkSize - 1) / kLoweringChunkSize);
+
+    vector<thread> threads;
+    for (unsigned i = 0; i < num_threads && i < chunks_.size(); ++i)
+        threads.push_back(thread(&ParallelLowering::Work, this));
+    for (auto &t : threads)
+        t.join();
+
+    llvm::Linker linker(*kState->the_module);
+    for (auto &lowered : chunks_) {
+        kState->diags.Append(lowered.diagnostics, lowered.num_errors, lowered.num_warnings);
+
+        // from the context of the thread into the one of kState
+        auto module = llvm::parseBitcodeFile(
+            llvm::MemoryBufferRef(llvm::StringRef(lowered.bitcode.data(), lowered.bitcode.size()), "chunk"),
+            kState->the_context);
+        if (!module) {
+            kState->diags.Error(llvm::toString(module.takeError()));
+            return false;
+        }
+        if (linker.linkInModule(move(*module))) {
+            kState->diags.Error("fail to link the generated chunks");
+            return false;
+        }
+    }
+    return true;
+}
+
+bool LowerParallel(const Ast &ast, const llvm::MemoryBuffer *source, unsigned num_threads) {
+    return ParallelLowering(ast, source).Run(num_threads);
+}
@@ -0,0 +1,25 @@
+#ifndef PARALLEL_LOWERING_H
+#define PARALLEL_LOWERING_H
+
+#include "abstract_syntax_tree.h"
+#include <llvm-9/llvm/Support/MemoryBuffer.h>
+
+// definitions resolved and generated as one unit of work
+const unsigned kLoweringChunkSize = 32;
+
+// Resolve and generate the top-level nodes of ast into the module of
+// kState, on num_threads threads.
+//
+// The prototypes of all definitions and externs are collected first, so a
+// definition can call any other, also a later one. The definitions are then
+// taken in chunks of kLoweringChunkSize by whichever thread is free, each
+// thread with a CompilerState, and so an LLVMContext, of its own. The
+// modules and diagnostics of the chunks are taken over in source order, so
+// the result does not depend on the scheduling. source locates the
+// diagnostics and may be nullptr.
+//
+// Small callees are only specialized and inlined within their chunk, the
+// optimizer inlines across chunks after linking. False if linking failed.
+bool LowerParallel(const Ast &ast, const llvm::MemoryBuffer *source, unsigned num_threads);
+
+#endif
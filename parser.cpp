@@ -1,53 +1,87 @@
 #include "parser.h"
 #include "tools.h"
+#include "compiler_state.h"
+#include "codegen.h"
+#include <llvm-9/llvm/ADT/StringSet.h>
 #include <cctype>
 #include <utility>
 #include <iostream>
 #include <vector>
 #include <cstdint>
 #include <cassert>
+#include <mutex>
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Scalar/GVN.h"
 
-extern llvm::LLVMContext kTheContext;
-extern llvm::IRBuilder<> kBuilder;
-extern std::unique_ptr<llvm::Module> kTheModule;
-extern std::map<std::string, llvm::Value *> kNamedValues;
-extern std::unique_ptr<llvm::legacy::FunctionPassManager> kTheFpm;
-extern std::unique_ptr<llvm::orc::KaleidoscopeJIT> kTheJit;
-extern std::map<std::string, std::unique_ptr<PrototypeAst>> kFunctionProtos;
-
-
 using namespace std;
 
 int Parser::GetNextToken() {
-    return cur_tok_ = lexer_.GetTok();
+    cur_tok_ = lexer_.GetTok();
+    // errors are reported at the token they are found at
+    kState->diags.set_location(lexer_.tok_offset());
+    return cur_tok_;
+}
+
+void Parser::Synchronize() {
+    while (cur_tok_ != kTokEof && cur_tok_ != kTokDef && cur_tok_ != kTokExtern) {
+        // the #pragma fp of the next definition, a loop #pragma in braces
+        // does not start one
+        if (cur_tok_ == kTokPragma && brace_depth_ == 0)
+            break;
+        int tok = cur_tok_;
+        GetNextToken();
+
+        if (tok == '{')
+            ++brace_depth_;
+        else if (tok == '}' && brace_depth_ > 0)
+            --brace_depth_;
+        if ((tok == ';' || tok == '}') && brace_depth_ == 0)
+            break;
+    }
+    brace_depth_ = 0;
 }
 
 int Parser::GetTokPrecedence() {
-    if (!isascii(cur_tok_))
+    auto prec = bin_op_precedence_.find(cur_tok_);
+    if (prec == bin_op_precedence_.end())
         return -1;
+    return prec->second;
+}
 
-    int tok_prec = bin_op_precedence_[cur_tok_];
-    if (tok_prec <= 0)
-        return -1;
-    return tok_prec;
+// the kNodeBinary operator of a token
+static uint8_t BinaryOperator(int tok) {
+    switch (tok) {
+    case kTokLessEqual:
+        return kOpLessEqual;
+    case kTokGreaterEqual:
+        return kOpGreaterEqual;
+    case kTokEqual:
+        return kOpEqual;
+    case kTokNotEqual:
+        return kOpNotEqual;
+    case kTokAnd:
+        return kOpAnd;
+    case kTokOr:
+        return kOpOr;
+    default:
+        return tok;
+    }
 }
 
-unique_ptr<ExprAst> Parser::ParseNumberExpr() {
-    auto result = make_unique<NumberExprAst>(lexer_.num_val());
+NodeId Parser::ParseNumberExpr() {
+    NodeId result = ast_.AddNumber(lexer_.tok_offset(), lexer_.num_val());
     GetNextToken();
-    return move(result);
+    return result;
 }
 
-unique_ptr<ExprAst> Parser::ParseParenExpr() {
+NodeId Parser::ParseParenExpr() {
     GetNextToken(); // eat '('
-    auto expr = ParseExpression();
-    if (!expr)
-        return nullptr;
+    NodeId expr = ParseExpression();
+    if (expr == kNoNode)
+        return kNoNode;
 
     if (cur_tok_ != ')')
         return LogError("expected ')'");
@@ -55,26 +89,37 @@ unique_ptr<ExprAst> Parser::ParseParenExpr() {
     return expr;
 }
 
-unique_ptr<ExprAst> Parser::ParseIdentifierExpr() {
-    string id_name = lexer_.identifier_str();
+NodeId Parser::ParseIdentifierExpr() {
+    unsigned offset = lexer_.tok_offset();
+    NameId id_name = ast_.Intern(lexer_.identifier());
 
     GetNextToken();
 
+    if (cur_tok_ == '[') {
+        GetNextToken(); // eat '['
+        NodeId index = ParseExpression();
+        if (index == kNoNode)
+            return kNoNode;
+
+        if (cur_tok_ != ']')
+            return LogError("expected ']'");
+        GetNextToken(); // eat ']'
+        return ast_.AddIndex(offset, id_name, index);
+    }
+
     if (cur_tok_ != '(')
         // simple variable reference
-        // construct a VariableExpreAst
-        return make_unique<VariableExprAst>(id_name);
+        return ast_.AddVariable(offset, id_name);
 
     // cur_tok_ == '(', which means a function call
-    // construct a CallExprAst
     GetNextToken(); // eat '('
-    vector<unique_ptr<ExprAst>> args;
+    vector<NodeId> args;
     if (cur_tok_ != ')') {
         while (true) {
-            if (auto arg = ParseExpression())
-                args.push_back(move(arg));
-            else
-                return nullptr;
+            NodeId arg = ParseExpression();
+            if (arg == kNoNode)
+                return kNoNode;
+            args.push_back(arg);
 
             if (cur_tok_ == ')')
                 break;
@@ -87,10 +132,10 @@ unique_ptr<ExprAst> Parser::ParseIdentifierExpr() {
 
     GetNextToken(); // eat ')'
 
-    return make_unique<CallExprAst>(id_name, move(args));
+    return ast_.AddCall(offset, id_name, args);
 }
 
-unique_ptr<ExprAst> Parser::ParsePrimary() {
+NodeId Parser::ParsePrimary() {
     switch (cur_tok_) {
         case kTokIdentifier:
             return ParseIdentifierExpr();
@@ -98,19 +143,25 @@ unique_ptr<ExprAst> Parser::ParsePrimary() {
             return ParseNumberExpr();
         case '(':
             return ParseParenExpr();
-        //case kTokIf:
-            //return ParseIfExpr();
-        //case kTokWhile:
-            //return ParseWhileExpr();
-        //case kTokInt:
-            //return ParseIntExpr();
         default:
-            cerr << "cut_tok_ " << cur_tok_ << endl;
+            YC_TRACE("unexpected token " + llvm::Twine(cur_tok_));
             return LogError("unknown token when expecting an expression");
     }
 }
 
-unique_ptr<ExprAst> Parser::ParseBinOpRhs(int expr_prec, unique_ptr<ExprAst> lhs) {
+NodeId Parser::ParseUnary() {
+    if (cur_tok_ != '!')
+        return ParsePrimary();
+
+    unsigned offset = lexer_.tok_offset();
+    GetNextToken(); // eat '!'
+    NodeId operand = ParseUnary();
+    if (operand == kNoNode)
+        return kNoNode;
+    return ast_.AddUnary(offset, '!', operand);
+}
+
+NodeId Parser::ParseBinOpRhs(int expr_prec, NodeId lhs) {
     // If this is a binop, find its precedence.
     while (true) {
         int tok_prec = GetTokPrecedence();
@@ -122,183 +173,355 @@ unique_ptr<ExprAst> Parser::ParseBinOpRhs(int expr_prec, unique_ptr<ExprAst> lhs
 
         // Okay, we know this is a binop. 
         int bin_op = cur_tok_;
+        unsigned op_offset = lexer_.tok_offset();
         GetNextToken();
 
-        // Parse the primary expression after the binary operator.
-        auto rhs = ParsePrimary();
-        if (!rhs)
-            return nullptr;
+        // Parse the unary expression after the binary operator.
+        NodeId rhs = ParseUnary();
+        if (rhs == kNoNode)
+            return kNoNode;
 
         // If BinOp binds less tightly with RHS than the operator after RHS, let
         // the pending operator take RHS as its LHS.
         int next_prec = GetTokPrecedence();
         if (tok_prec < next_prec) {
-            rhs = ParseBinOpRhs(tok_prec + 1, move(rhs));
-            if (!rhs)
-                return nullptr;
+            rhs = ParseBinOpRhs(tok_prec + 1, rhs);
+            if (rhs == kNoNode)
+                return kNoNode;
         }
 
         // Merge LHS/RHS.
-        lhs = make_unique<BinaryExprAst>(bin_op, move(lhs), move(rhs));
+        lhs = ast_.AddBinary(op_offset, BinaryOperator(bin_op), lhs, rhs);
     }
 }
 
-unique_ptr<ExprAst> Parser::ParseExpression() {
-    auto lhs = ParsePrimary();
-    if (!lhs)
-        return nullptr;
+NodeId Parser::ParseExpression() {
+    NodeId lhs = ParseUnary();
+    if (lhs == kNoNode)
+        return kNoNode;
 
-    return ParseBinOpRhs(0, move(lhs));
+    return ParseBinOpRhs(0, lhs);
 }
 
-unique_ptr<PrototypeAst> Parser::ParsePrototype() {
+NodeId Parser::ParsePrototype() {
     if (cur_tok_ != kTokIdentifier)
-        return LogErrorP("Expected function name in prototype");
+        return LogError("Expected function name in prototype");
 
-    string fn_name = lexer_.identifier_str();
+    unsigned offset = lexer_.tok_offset();
+    NameId fn_name = ast_.Intern(lexer_.identifier());
     GetNextToken();
 
     if (cur_tok_ != '(')
-        return LogErrorP("Expected '(' in prototype");
+        return LogError("Expected '(' in prototype");
 
-    vector<string> arg_names;
+    vector<NameId> arg_names;
     GetNextToken();
     while (cur_tok_ == kTokInt) {
         GetNextToken(); // eat "double"
 
         if (cur_tok_ != kTokIdentifier)
-            return LogErrorP("Expected identifier in prototype");
-        arg_names.push_back(lexer_.identifier_str());
+            return LogError("Expected identifier in prototype");
+        arg_names.push_back(ast_.Intern(lexer_.identifier()));
         GetNextToken();
 
         if (cur_tok_ == ',')
             GetNextToken(); // eat ','
     }
     if (cur_tok_ != ')')
-        return LogErrorP("Expected ')' in prototype");
+        return LogError("Expected ')' in prototype");
 
     GetNextToken();
 
-    return make_unique<PrototypeAst>(fn_name, move(arg_names));
+    return ast_.AddPrototype(offset, fn_name, arg_names);
 }
 
-unique_ptr<FunctionAst> Parser::ParseDefinition() {
-    GetNextToken();
-    auto proto = ParsePrototype();
-    if (!proto)
-        return nullptr;
+bool Parser::ParseFpPragma(uint16_t &fp_flags) {
+    GetNextToken(); // eat '#pragma'
 
-    if (auto compound_stat = ParseCompoundStat()) {
+    if (cur_tok_ != kTokIdentifier || lexer_.identifier() != "fp") {
+        LogError("expected fp after #pragma in front of a definition");
+        return false;
+    }
+    GetNextToken(); // eat 'fp'
 
-        return make_unique<FunctionAst>(move(proto), move(compound_stat));
+    if (cur_tok_ != '(') {
+        LogError("expected '(' after fp");
+        return false;
     }
-   
-    LogError("Parse CS failed");
-    return nullptr;
+    GetNextToken(); // eat '('
+
+    static const struct { const char *name; uint16_t flags; } kFpFlags[] = {
+        {"fast", kFpFast},         {"strict", 0},           {"reassoc", kFpReassoc},
+        {"nnan", kFpNoNaNs},       {"ninf", kFpNoInfs},     {"nsz", kFpNoSignedZeros},
+        {"arcp", kFpAllowReciprocal}, {"contract", kFpContract}, {"afn", kFpApproxFunc}};
+    fp_flags |= kFpOverride;
+    while (true) {
+        bool known = false;
+        for (auto &flag : kFpFlags) {
+            if (cur_tok_ == kTokIdentifier && lexer_.identifier() == flag.name) {
+                fp_flags |= flag.flags;
+                known = true;
+            }
+        }
+        if (!known) {
+            LogError("unknown fp flag, expected fast, strict, reassoc, nnan, ninf, nsz, arcp, contract or afn");
+            return false;
+        }
+        GetNextToken(); // eat flag
+
+        if (cur_tok_ == ')')
+            break;
+        if (cur_tok_ != ',') {
+            LogError("expected ')' or ',' in #pragma fp");
+            return false;
+        }
+        GetNextToken(); // eat ','
+    }
+    GetNextToken(); // eat ')'
+    return true;
+}
+
+NodeId Parser::ParseDefinition() {
+    uint16_t fp_flags = 0;
+    while (cur_tok_ == kTokPragma)
+        if (!ParseFpPragma(fp_flags))
+            return kNoNode;
+    if (cur_tok_ != kTokDef)
+        return LogError("expected def after #pragma fp");
+
+    unsigned offset = lexer_.tok_offset();
+    GetNextToken();
+    NodeId proto = ParsePrototype();
+    if (proto == kNoNode)
+        return kNoNode;
+
+    // the body reported its own error
+    NodeId compound_stat = ParseCompoundStat();
+    if (compound_stat == kNoNode)
+        return kNoNode;
+    return ast_.AddFunction(offset, proto, compound_stat, fp_flags);
 }
 
-unique_ptr<FunctionAst> Parser::ParseTopLevelExpr() {
-    //if (auto expr = ParseExpression()) {
-        //auto proto = make_unique<PrototypeAst>("__anon_expr", vector<string>());
-        //return make_unique<FunctionAst>(move(proto), move(expr));
-    //}
-    return nullptr;
+NodeId Parser::ParseTopLevelExpr() {
+    unsigned offset = lexer_.tok_offset();
+    NodeId expr = ParseExpression();
+    if (expr == kNoNode)
+        return kNoNode;
+
+    // { return expr; } in a function of its own, numbered so that a
+    // whole batch of expressions fits into one module
+    string name = "__anon_expr" + to_string(kState->num_anon_exprs++);
+    NodeId proto = ast_.AddPrototype(offset, name, {});
+    NodeId ret = ast_.AddReturn(offset, expr);
+    NodeId body = ast_.AddCompound(offset, {}, ret);
+    return ast_.AddFunction(offset, proto, body);
 }
 
-unique_ptr<PrototypeAst> Parser::ParseExtern() {
+NodeId Parser::ParseExtern() {
     GetNextToken();
     return ParsePrototype();
 }
 
-unique_ptr<StatAst> Parser::ParseIfStat() {
+NodeId Parser::ParseGlobal() {
+    unsigned offset = lexer_.tok_offset();
+    bool is_const = cur_tok_ == kTokConst;
+    if (is_const) {
+        GetNextToken(); // eat 'const'
+        if (cur_tok_ != kTokInt)
+            return LogError("expected 'double' after 'const'");
+    }
+    GetNextToken(); // eat 'double'
+
+    if (cur_tok_ != kTokIdentifier)
+        return LogError("expected identifier after 'double'");
+    NameId name = ast_.Intern(lexer_.identifier());
+    GetNextToken();
+
+    uint32_t size = 0;
+    if (cur_tok_ == '[') {
+        GetNextToken(); // eat '['
+        if (cur_tok_ != kTokNumber || lexer_.num_val() < 1 || lexer_.num_val() != uint32_t(lexer_.num_val()))
+            return LogError("expected a positive integer array size");
+        size = uint32_t(lexer_.num_val());
+        GetNextToken(); // eat number
+
+        if (cur_tok_ != ']')
+            return LogError("expected ']'");
+        GetNextToken(); // eat ']'
+    }
+
+    vector<NodeId> init;
+    if (cur_tok_ == '=') {
+        GetNextToken(); // eat '='
+        if (size == 0) {
+            NodeId item = ParseExpression();
+            if (item == kNoNode)
+                return kNoNode;
+            init.push_back(item);
+        } else {
+            if (cur_tok_ != '{')
+                return LogError("expected '{' before array initializer");
+            GetNextToken(); // eat '{'
+            ++brace_depth_;
+
+            while (cur_tok_ != '}') {
+                NodeId item = ParseExpression();
+                if (item == kNoNode)
+                    return kNoNode;
+                init.push_back(item);
+
+                if (cur_tok_ == '}')
+                    break;
+                if (cur_tok_ != ',')
+                    return LogError("expected '}' or ',' in array initializer");
+                GetNextToken(); // eat ','
+            }
+            GetNextToken(); // eat '}'
+            --brace_depth_;
+        }
+    }
+
+    if (cur_tok_ != ';')
+        return LogError("expected ';'");
+    GetNextToken(); // eat ';'
+
+    return ast_.AddGlobal(offset, name, is_const, size, init);
+}
+
+NodeId Parser::ParseIfStat() {
+    unsigned offset = lexer_.tok_offset();
     GetNextToken(); // eat 'if'
 
     if (cur_tok_ != '(')
-        return LogErrorS("expected '('");
+        return LogError("expected '('");
     GetNextToken(); // eat '('
 
     // condition
-    auto cond = ParseExpression();
-    if (!cond)
-        return nullptr;
+    NodeId cond = ParseExpression();
+    if (cond == kNoNode)
+        return kNoNode;
 
     if (cur_tok_ != ')')
-        return LogErrorS("expected ')'");
+        return LogError("expected ')'");
     GetNextToken(); // ')'
 
-    auto then_stat = ParseCompoundStat();
-    if (!then_stat)
-        return nullptr;
+    NodeId then_stat = ParseCompoundStat();
+    if (then_stat == kNoNode)
+        return kNoNode;
 
     if (cur_tok_ != kTokElse) {
         // if - then expression
-        cerr << "cur_tok_ " << cur_tok_ << endl;
-        return LogErrorS("expected else");
+        YC_TRACE("unexpected token " + llvm::Twine(cur_tok_));
+        return LogError("expected else");
     }
 
     GetNextToken();
 
-    auto else_stat = ParseCompoundStat();
-    if (!else_stat)
-        return nullptr;
-    return make_unique<IfStatAst>(move(cond), move(then_stat), move(else_stat));
+    NodeId else_stat = ParseCompoundStat();
+    if (else_stat == kNoNode)
+        return kNoNode;
+    return ast_.AddIf(offset, cond, then_stat, else_stat);
 }
 
-unique_ptr<StatAst> Parser::ParseWhileStat() {
+bool Parser::ParsePragma(LoopHints &hints) {
+    GetNextToken(); // eat '#pragma'
+
+    if (cur_tok_ != kTokIdentifier) {
+        LogError("expected loop hint after #pragma");
+        return false;
+    }
+    llvm::StringRef name = lexer_.identifier();
+    uint32_t *hint;
+    if (name == "unroll")
+        hint = &hints.unroll;
+    else if (name == "vectorize")
+        hint = &hints.vectorize_width;
+    else if (name == "interleave")
+        hint = &hints.interleave;
+    else {
+        LogError("unknown loop hint, expected unroll, vectorize or interleave");
+        return false;
+    }
+    GetNextToken(); // eat name
+
+    if (cur_tok_ != '(') {
+        LogError("expected '(' after loop hint");
+        return false;
+    }
+    GetNextToken(); // eat '('
+
+    if (cur_tok_ != kTokNumber || lexer_.num_val() < 1 || lexer_.num_val() != uint32_t(lexer_.num_val())) {
+        LogError("expected a positive integer in loop hint");
+        return false;
+    }
+    *hint = uint32_t(lexer_.num_val());
+    GetNextToken(); // eat number
+
+    if (cur_tok_ != ')') {
+        LogError("expected ')' after loop hint");
+        return false;
+    }
+    GetNextToken(); // eat ')'
+    return true;
+}
+
+NodeId Parser::ParseWhileStat(LoopHints hints) {
+    unsigned offset = lexer_.tok_offset();
     GetNextToken(); // eat 'while'
 
     if (cur_tok_ != '(')
-        return LogErrorS("expected '(' after while");
+        return LogError("expected '(' after while");
     GetNextToken(); // eat '('
 
     // condition
-    auto cond = ParseExpression();
-    if (!cond)
-        return nullptr;
+    NodeId cond = ParseExpression();
+    if (cond == kNoNode)
+        return kNoNode;
 
     if (cur_tok_ != ')')
-        return LogErrorS("expected ')'");
+        return LogError("expected ')'");
     GetNextToken(); // eat ')'
 
-    auto body = ParseCompoundStat();
-    if (!body)
-        return nullptr;
+    NodeId body = ParseCompoundStat();
+    if (body == kNoNode)
+        return kNoNode;
 
-    return make_unique<WhileStatAst>(move(cond), move(body));
+    return ast_.AddWhile(offset, cond, body, hints);
 }
 
 // 语句块
-unique_ptr<CompoundStatAst> Parser::ParseCompoundStat() {
-    
+NodeId Parser::ParseCompoundStat() {
+    unsigned offset = lexer_.tok_offset();
     if (cur_tok_ != '{')
-        return LogErrorCS("expected '{'");
+        return LogError("expected '{'");
     GetNextToken(); // eat '{'
+    ++brace_depth_;
 
-    vector<pair<string, unique_ptr<ExprAst>>> var_names;
-    unique_ptr<StatListAst> body;
+    vector<pair<NameId, NodeId>> var_names;
+    vector<NodeId> body;
 
     if (cur_tok_ == kTokInt) {
         GetNextToken(); // eat 'double'
 
         // At least one variable is required.
         if (cur_tok_ != kTokIdentifier)
-            return LogErrorCS("expected identifier after 'int'");
+            return LogError("expected identifier after 'int'");
 
         while (true) {
-            string name = lexer_.identifier_str();
+            NameId name = ast_.Intern(lexer_.identifier());
             GetNextToken(); // eat identifier
 
             // Read the optional initializer.
-            unique_ptr<ExprAst> init; // initializer
+            NodeId init = kNoNode;
             if (cur_tok_ == '=') {
                 GetNextToken();
 
                 init = ParseExpression();
-                if (!init)
-                    return nullptr;
+                if (init == kNoNode)
+                    return kNoNode;
             }
 
-            var_names.push_back(make_pair(name, move(init)));
+            var_names.push_back(make_pair(name, init));
 
             // End of var list, exit loop.
             if (cur_tok_ != ',')
@@ -306,162 +529,264 @@ unique_ptr<CompoundStatAst> Parser::ParseCompoundStat() {
 
             GetNextToken(); // eat ','
             if (cur_tok_ != kTokIdentifier)
-                return LogErrorCS("expected identifier list after var");
+                return LogError("expected identifier list after var");
         }
 
         if (cur_tok_ != ';')
-            return LogErrorCS("expected ';'");
+            return LogError("expected ';'");
         GetNextToken(); // eat ';'
-
-        // body
-        body = ParseStatList();
-        if (!body)
-            return nullptr;
-        
-    } else {
-        // no vairable declare
-        body = ParseStatList();
-        if (!body)
-            return nullptr;
     }
-    
+
+    // body
+    if (!ParseStatList(body))
+        return kNoNode;
+
     if (cur_tok_ != '}')
-        return LogErrorCS("expected '}'");
+        return LogError("expected '}'");
     GetNextToken(); // eat '}'
+    --brace_depth_;
 
-    return make_unique<CompoundStatAst>(move(var_names), move(body));
+    return ast_.AddCompound(offset, var_names, body);
 }
 
 // 语句串
-unique_ptr<StatListAst> Parser::ParseStatList() {
-    vector<unique_ptr<StatAst>> stat_list;
-    bool loop = true;
-
-    unique_ptr<StatAst> stat;
-
-    while (loop) {
+bool Parser::ParseStatList(vector<NodeId> &stats) {
+    while (true) {
+        NodeId stat;
         switch (cur_tok_) {
             case kTokIf:
                 stat = ParseIfStat();
-                if (!stat)
-                    return nullptr;
-                stat_list.push_back(move(stat));
                 break;
             case kTokWhile:
                 stat = ParseWhileStat();
-                if (!stat)
-                    return nullptr;
-                stat_list.push_back(move(stat));
                 break;
+            case kTokPragma: {
+                // hints for the loop that follows
+                LoopHints hints;
+                while (cur_tok_ == kTokPragma)
+                    if (!ParsePragma(hints))
+                        return false;
+                if (cur_tok_ != kTokWhile) {
+                    LogError("expected while after #pragma");
+                    return false;
+                }
+                stat = ParseWhileStat(hints);
+                break;
+            }
             case kTokReturn:
                 stat = ParseReturnStat();
-                if (!stat)
-                    return nullptr;
-                stat_list.push_back(move(stat));
                 break;
             case kTokIdentifier:
                 stat = ParseAssignmentStat();
-                if (!stat)
-                    return nullptr;
-                stat_list.push_back(move(stat));
                 break;
             default:
-                loop = false;
-                break;
+                return true;
         }
+        if (stat == kNoNode)
+            return false;
+        stats.push_back(stat);
     }
-    return make_unique<StatListAst>(move(stat_list));
 }
 
 // return 语句
-unique_ptr<StatAst> Parser::ParseReturnStat() {
+NodeId Parser::ParseReturnStat() {
+    unsigned offset = lexer_.tok_offset();
     GetNextToken(); // eat "return"
 
-    auto expr = ParseExpression();
-    if (!expr)
-        return nullptr;
+    NodeId expr = ParseExpression();
+    if (expr == kNoNode)
+        return kNoNode;
     
     if (cur_tok_ != ';')
-        return LogErrorS("expected ';'");
+        return LogError("expected ';'");
     GetNextToken(); // eat ';'
 
-    return make_unique<ReturnStatAst>(move(expr));
+    return ast_.AddReturn(offset, expr);
 }
 
 // 赋值语句
-unique_ptr<StatAst> Parser::ParseAssignmentStat() {
-    string id_name = lexer_.identifier_str();
+NodeId Parser::ParseAssignmentStat() {
+    unsigned offset = lexer_.tok_offset();
+    NameId id_name = ast_.Intern(lexer_.identifier());
 
     GetNextToken(); // eat identifier
 
     if (cur_tok_ != '=')
-        return LogErrorS("expected '='");
+        return LogError("expected '='");
     GetNextToken(); // eat '='
 
-    auto expr = ParseExpression();
-    if (!expr)
-        return nullptr;
+    NodeId expr = ParseExpression();
+    if (expr == kNoNode)
+        return kNoNode;
 
     if (cur_tok_ != ';')
-        return LogErrorS("expected ';'");
+        return LogError("expected ';'");
     GetNextToken(); // eat ';'
 
-    return make_unique<AssignmentStatAst>(id_name, move(expr));
+    return ast_.AddAssignment(offset, id_name, expr);
 }
 
 void Parser::HandleDefinition() {
-    cerr << "HandleDefinition" << endl;
-    if (auto fn_ast = ParseDefinition()) {
-        cerr << "HandleDefinition success" << endl;
-        if (auto *fn_ir = fn_ast->CodeGen()) {
-            cerr << "Read function definition: ";
-            fn_ir->print(llvm::errs());
-            cerr << endl;
-            //kTheJit->addModule(std::move(kTheModule));
-            //InitializeModuleAndPassManager();
-        }
-    } else {
-        cerr << "HandleDefinition failed" << endl;
-        GetNextToken();
+    NodeId fn = ParseDefinition();
+    if (fn == kNoNode) {
+        YC_TRACE("skipping to the next definition");
+        Synchronize();
+        return;
     }
+
+    ast_.AddTopLevel(fn);
+    if (deferred_ || !Resolver(ast_, resolution_).Resolve(fn))
+        return;
+
+    llvm::Function *fn_ir = CodeGenerator(ast_, resolution_).EmitFunction(fn);
+    if (print_ir_) {
+        llvm::errs() << "Read function definition: ";
+        fn_ir->print(llvm::errs());
+        llvm::errs() << "\n";
+    }
+    if (kState->map_entry_points)
+        CreateMapEntryPoint(fn_ir);
 }
 
 void Parser::HandleExtern() {
-    if (auto proto_ast = ParseExtern()) {
-        if (auto *fn_ir = proto_ast->CodeGen()) {
-            cerr << "Read extern: ";
-            fn_ir->print(llvm::errs());
-            cerr << endl;
-            kFunctionProtos[proto_ast->name()] = move(proto_ast);
-        }
-    } else {
-        GetNextToken();
+    NodeId proto = ParseExtern();
+    if (proto == kNoNode) {
+        Synchronize();
+        return;
+    }
+
+    ast_.AddTopLevel(proto);
+    if (deferred_ || !Resolver(ast_, resolution_).Resolve(proto))
+        return;
+
+    llvm::Function *fn_ir = CodeGenerator(ast_, resolution_).EmitExtern(proto);
+    if (print_ir_) {
+        llvm::errs() << "Read extern: ";
+        fn_ir->print(llvm::errs());
+        llvm::errs() << "\n";
+    }
+}
+
+void Parser::HandleGlobal() {
+    NodeId global = ParseGlobal();
+    if (global == kNoNode) {
+        Synchronize();
+        return;
+    }
+
+    ast_.AddTopLevel(global);
+    if (deferred_ || !Resolver(ast_, resolution_).Resolve(global))
+        return;
+
+    llvm::GlobalVariable *gv = CodeGenerator(ast_, resolution_).EmitGlobal(global);
+    if (print_ir_) {
+        llvm::errs() << "Read global: ";
+        gv->print(llvm::errs());
+        llvm::errs() << "\n";
     }
 }
 
 void Parser::HandleTopLevelExpression() {
-    if (auto fn_ast = ParseTopLevelExpr()) {
-        //if (auto *fn_ir = fn_ast->CodeGen()) {
-            
-            //auto h = kTheJit->addModule(move(kTheModule));
-            //InitializeModuleAndPassManager();
-
-            //auto expr_symbol = kTheJit->findSymbol("__anon_expr");
-            //assert(expr_symbol && "Function not found");
-
-            //double (*fp)() = (double (*)())(intptr_t)llvm::cantFail(expr_symbol.getAddress());
-            //cerr << "Evaluated to " << fp() << endl;
-
-            //kTheJit->removeModule(h);
-        //}
-        fn_ast->CodeGen();
-    } else {
-        GetNextToken();
+    NodeId fn = ParseTopLevelExpr();
+    if (fn == kNoNode) {
+        Synchronize();
+        return;
     }
+
+    if (deferred_) {
+        kState->diags.Warning("top-level expressions are only run with --eval");
+        return;
+    }
+    if (!Resolver(ast_, resolution_).Resolve(fn))
+        return;
+
+    // Expressions go into their own module, which is thrown away after
+    // they ran, the definitions stay in the module of the state.
+    if (!kState->expr_module)
+        kState->expr_module = std::make_unique<llvm::Module>("top-level exprs", kState->the_context);
+
+    swap(kState->the_module, kState->expr_module);
+    llvm::Function *fn_ir = CodeGenerator(ast_, resolution_).EmitFunction(fn);
+    swap(kState->the_module, kState->expr_module);
+
+    if (print_ir_) {
+        llvm::errs() << "Read top-level expression: ";
+        fn_ir->print(llvm::errs());
+        llvm::errs() << "\n";
+    }
+    kState->anon_exprs.push_back(fn_ir->getName().str());
+}
+
+// prototype ::= id '(' ('double' id ','?)* ')', without reporting errors
+static bool SkimPrototype(Lexer &lexer, int &tok, Prototype &proto) {
+    if (tok != kTokIdentifier)
+        return false;
+    proto.name = lexer.identifier().str();
+    if ((tok = lexer.GetTok()) != '(')
+        return false;
+
+    tok = lexer.GetTok();
+    while (tok == kTokInt) {
+        if ((tok = lexer.GetTok()) != kTokIdentifier)
+            return false;
+        proto.args.push_back(lexer.identifier().str());
+        if ((tok = lexer.GetTok()) == ',')
+            tok = lexer.GetTok();
+    }
+    if (tok != ')')
+        return false;
+    tok = lexer.GetTok();
+    return true;
+}
+
+void Parser::CollectDeclarations() {
+    // Over the tokens of the parser, replayed from its token cache if it
+    // has one. The parse starts over at the first token afterwards.
+    lexer_.Rewind();
+
+    // The first declaration of a name in the source is the one that
+    // counts, parsing reports any that conflicts with it.
+    llvm::StringSet<> declared;
+    int tok = lexer_.GetTok();
+    while (tok != kTokEof) {
+        if (tok != kTokDef && tok != kTokExtern) {
+            tok = lexer_.GetTok();
+            continue;
+        }
+
+        bool definition = tok == kTokDef;
+        Prototype proto;
+        tok = lexer_.GetTok();
+        if (!SkimPrototype(lexer_, tok, proto))
+            continue;
+        proto.is_extern = !definition;
+        if (declared.insert(proto.name).second)
+            kState->function_protos[proto.name] = move(proto);
+        else if (definition)
+            kState->function_protos[proto.name].is_extern = false;
+
+        if (definition && tok == '{') {
+            int depth = 0;
+            do {
+                if (tok == '{')
+                    ++depth;
+                else if (tok == '}')
+                    --depth;
+                tok = lexer_.GetTok();
+            } while (depth > 0 && tok != kTokEof);
+        }
+    }
+
+    lexer_.Rewind();
+    GetNextToken();
 }
 
 void Parser::MainLoop() {
-    while (true) {
+    // LowerParallel collects the declarations from the whole Ast
+    if (!deferred_)
+        CollectDeclarations();
+
+    while (!kState->diags.TooManyErrors()) {
         switch (cur_tok_) {
             case kTokEof:
                 return;
@@ -469,9 +794,13 @@ void Parser::MainLoop() {
                 GetNextToken();
                 break;
             case kTokDef:
-            case kTokInt: // that means global variables are not supported 
+            case kTokPragma:
                 HandleDefinition();
                 break;
+            case kTokInt:
+            case kTokConst:
+                HandleGlobal();
+                break;
             case kTokExtern:
                 HandleExtern();
                 break;
@@ -482,33 +811,54 @@ void Parser::MainLoop() {
     }
 }
 
-Parser::Parser(string file_path) {
-    llvm::InitializeNativeTarget();
-    llvm::InitializeNativeTargetAsmPrinter();
-    llvm::InitializeNativeTargetAsmParser();
-    
+void Parser::Initialize() {
+    InitializeNativeTargetOnce();
+
+    if (auto *source = lexer_.source())
+        kState->diags.SetSource(source->getBufferIdentifier(), source->getBuffer());
 
     // 1 is the lowest precedence.
     bin_op_precedence_['='] = 2;
+    bin_op_precedence_[kTokOr] = 4;
+    bin_op_precedence_[kTokAnd] = 6;
+    bin_op_precedence_[kTokEqual] = 8;
+    bin_op_precedence_[kTokNotEqual] = 8;
     bin_op_precedence_['<'] = 10;
+    bin_op_precedence_['>'] = 10;
+    bin_op_precedence_[kTokLessEqual] = 10;
+    bin_op_precedence_[kTokGreaterEqual] = 10;
     bin_op_precedence_['+'] = 20;
     bin_op_precedence_['-'] = 20;
     bin_op_precedence_['*'] = 40;
-    
-    lexer_.SetFilePath(file_path);
-    if (!lexer_.IsFileOpen())
-        cerr << "fail to open source file " << file_path << endl;
-    
+    bin_op_precedence_['/'] = 40;
+
     GetNextToken();
 
-    //kTheJit = make_unique<llvm::orc::KaleidoscopeJIT>();
+    //kState->the_jit = make_unique<llvm::orc::KaleidoscopeJIT>();
 
     //InitializeModuleAndPassManager();
-    kTheModule = std::make_unique<llvm::Module>("my awesome jit", kTheContext);
-
+    // A state compiles any number of sources into one module.
+    if (!kState->the_module)
+        kState->the_module = std::make_unique<llvm::Module>("my awesome jit", kState->the_context);
 }
 
+Parser::Parser(string file_path, bool use_token_cache) {
+    lexer_.SetFilePath(file_path);
+    if (!lexer_.IsFileOpen())
+        kState->diags.Error("fail to open source file " + file_path);
+    else if (use_token_cache)
+        lexer_.UseTokenCache(file_path + ".ytc");
 
+    Initialize();
+}
 
+Parser::Parser(unique_ptr<llvm::MemoryBuffer> source) {
+    lexer_.SetSource(move(source));
+    Initialize();
+}
 
-
+Parser::~Parser() {
+    // the diagnostics refer to the source of the lexer
+    kState->diags.ClearSource();
+    kState->diags.Flush();
+}
@@ -3,7 +3,9 @@
 
 #include <map>
 #include <memory>
+#include <vector>
 #include "abstract_syntax_tree.h"
+#include "resolver.h"
 #include "lexer.h"
 #include <llvm-9/llvm/ADT/APFloat.h>
 #include <llvm-9/llvm/ADT/STLExtras.h>
@@ -22,6 +24,17 @@ class Parser {
 protected:
     Lexer lexer_;
     int cur_tok_;
+    // '{' not closed yet, for Synchronize
+    int brace_depth_ = 0;
+
+    // everything parsed from the source, the definitions and externs are
+    // its top-level nodes
+    Ast ast_;
+    Resolution resolution_;
+    // dump the IR of each definition and extern to stderr
+    bool print_ir_ = false;
+    // only parse, the top-level nodes are generated later, see LowerParallel
+    bool deferred_ = false;
 
     /* LLVM objects */
 //    llvm::LLVMContext the_context_;
@@ -30,36 +43,54 @@ protected:
 //    std::map<std::string, llvm::Value *> named_values_;
 
     // BinopPrecedence - This holds the precedence for each binary operator that
-    // is defined.
-    std::map<char, int> bin_op_precedence_;
+    // is defined, by token.
+    std::map<int, int> bin_op_precedence_;
 
     int GetNextToken();
 
+    // Panic mode recovery after an error: skip tokens until one a top-level
+    // construct can start after, that is past a ';' or '}' outside of any
+    // braces, or at a def, extern or a #pragma outside of braces.
+    void Synchronize();
+
+    void Initialize();
+
+    // Declaration pre-pass: register the prototype of every def and extern
+    // of the source in function_protos before anything is parsed, so a
+    // definition can call a later one. Bodies are skipped by matching
+    // braces, not parsed.
+    void CollectDeclarations();
+
     // GetTokPrecedence - Get the precedence of the pending binary operator token.
     int GetTokPrecedence();
 
     // numberexpr ::= number
-    std::unique_ptr<ExprAst> ParseNumberExpr();
+    NodeId ParseNumberExpr();
 
     // parenexpr ::= '(' expression ')'
-    std::unique_ptr<ExprAst> ParseParenExpr();
+    NodeId ParseParenExpr();
 
     // identifierexpr
     //   ::= identifier
     //   ::= identifier '(' expression* ')'
-    //   the second is function call
-    std::unique_ptr<ExprAst> ParseIdentifierExpr();
+    //   ::= identifier '[' expression ']'
+    //   the second is function call, the third indexes an array
+    NodeId ParseIdentifierExpr();
 
     // primary
     //   ::= identifierexpr
     //   ::= numberexpr
     //   ::= parenexpr
-    std::unique_ptr<ExprAst> ParsePrimary();
+    NodeId ParsePrimary();
+
+    // unary
+    //   ::= '!' unary
+    //   ::= primary
+    NodeId ParseUnary();
     
     // binoprhs (binary oprator right hand side)
-    //   ::= ('+' primary)*
-    std::unique_ptr<ExprAst> ParseBinOpRhs(int expr_prec, 
-            std::unique_ptr<ExprAst> lhs);
+    //   ::= ('+' unary)*
+    NodeId ParseBinOpRhs(int expr_prec, NodeId lhs);
 
     // statement
     //   ::= expression
@@ -67,50 +98,78 @@ protected:
 
 
     // expression
-    //   ::= primary binoprhs
-    std::unique_ptr<ExprAst> ParseExpression();
+    //   ::= unary binoprhs
+    NodeId ParseExpression();
 
     // prototype
     // ::= id '(' id* ')'
-    std::unique_ptr<PrototypeAst> ParsePrototype();
+    NodeId ParsePrototype();
+
+    // definition ::= fppragma* 'def' prototype '{' expression '}'
+    NodeId ParseDefinition();
 
-    // definition ::= 'def' prototype '{' expression '}'
-    std::unique_ptr<FunctionAst> ParseDefinition();
+    // fppragma ::= '#pragma' 'fp' '(' fpflag (',' fpflag)* ')'
+    // fpflag ::= 'fast' | 'strict' | 'reassoc' | 'nnan' | 'ninf' | 'nsz' | 'arcp'
+    //          | 'contract' | 'afn'
+    // adds the flags to fp_flags, kFpOverride included
+    bool ParseFpPragma(uint16_t &fp_flags);
 
     // toplevelexpr ::= expression
-    std::unique_ptr<FunctionAst> ParseTopLevelExpr();
+    //   wrapped into a function __anon_expr<n>() { return expression; }
+    NodeId ParseTopLevelExpr();
 
     // external ::= 'extern' prototype
-    std::unique_ptr<PrototypeAst> ParseExtern();
+    NodeId ParseExtern();
+
+    // global ::= 'const'? 'double' identifier ('[' number ']')?
+    //            ('=' (expression | '{' expression (',' expression)* '}'))? ';'
+    NodeId ParseGlobal();
     
     // ifexpr ::= 'if' '(' expression ')' expression 'else' expression
-    std::unique_ptr<StatAst> ParseIfStat();
+    NodeId ParseIfStat();
     
-    // whileexpr ::= 'while' '(' expression ')' expression
-    std::unique_ptr<StatAst> ParseWhileStat();
+    // whileexpr ::= pragma* 'while' '(' expression ')' expression
+    NodeId ParseWhileStat(LoopHints hints = LoopHints());
+
+    // pragma ::= '#pragma' ('unroll' | 'vectorize' | 'interleave') '(' number ')'
+    bool ParsePragma(LoopHints &hints);
 
-    std::unique_ptr<StatAst> ParseReturnStat();
+    NodeId ParseReturnStat();
 
-    std::unique_ptr<StatAst> ParseAssignmentStat();
+    NodeId ParseAssignmentStat();
 
     // intexpr ::= 'int' identifier ('=' expression)?
     // (',' identifier ('=' expression)?)* 'in' expression
-    std::unique_ptr<CompoundStatAst> ParseCompoundStat();
+    NodeId ParseCompoundStat();
 
-    std::unique_ptr<StatListAst> ParseStatList();
+    // statements up to the closing '}' of a compound
+    bool ParseStatList(std::vector<NodeId> &stats);
 
 
     /* Top-Level parsing */
     void HandleDefinition();
     void HandleExtern();
+    void HandleGlobal();
     void HandleTopLevelExpression();
 public:
-    Parser(std::string);
-//    ~Parser();
-
-    // main loop
-    // top ::= definition | external | expression | ';'
+    // use_token_cache - lex through "<file_path>.ytc", see token_cache.h
+    Parser(std::string file_path, bool use_token_cache = false);
+    // parse a source held in memory
+    Parser(std::unique_ptr<llvm::MemoryBuffer> source);
+    ~Parser();
+
+    void set_print_ir(bool print_ir) { print_ir_ = print_ir; }
+    // Parse without generating any code. Top-level expressions are dropped
+    // with a warning.
+    void set_deferred(bool deferred) { deferred_ = deferred; }
+
+    // main loop, until the end of the source or the error limit
+    // top ::= definition | external | global | expression | ';'
     void MainLoop();
+
+    const Ast &ast() const { return ast_; }
+    // nullptr if no source could be opened
+    const llvm::MemoryBuffer *source() const { return lexer_.source(); }
 };
 
 
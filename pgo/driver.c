@@ -0,0 +1,15 @@
+/* Runs the definitions of hot.yc to train a profile, see run_pgo.sh. */
+#include <stdio.h>
+
+double sum(double n);
+double scale(double x);
+
+int main(void) {
+    double total = 0;
+    for (int i = 0; i < 20000; ++i) {
+        total += sum(i % 64);
+        total += scale(i);
+    }
+    printf("%g\n", total);
+    return 0;
+}
@@ -0,0 +1,36 @@
+#!/bin/sh
+# Profile-guided build of hot.yc, end to end on the local machine:
+#   1. compile it instrumented with --profile-generate
+#   2. link it with driver.c and the profile runtime, run it
+#   3. merge the raw profile with llvm-profdata
+#   4. compile it again with --profile-use and check that the IR carries
+#      the branch weights of the profile
+# The tools can be overridden, e.g. YC=../yc CC=clang-9 PROFDATA=llvm-profdata-9.
+set -e
+
+dir=$(cd "$(dirname "$0")" && pwd)
+YC=${YC:-$dir/../yc}
+CC=${CC:-clang-9}
+PROFDATA=${PROFDATA:-llvm-profdata-9}
+out=${OUT:-$dir/out}
+mkdir -p "$out"
+
+# the instrumented and the optimized build must use the same -O<n>
+"$YC" -O2 --profile-generate="$out/hot.profraw" "$dir/hot.yc" "$out/hot.gen.o"
+# -fprofile-instr-generate links the compiler-rt profile runtime
+"$CC" -fprofile-instr-generate "$dir/driver.c" "$out/hot.gen.o" -o "$out/driver.gen"
+rm -f "$out/hot.profraw"
+LLVM_PROFILE_FILE="$out/hot.profraw" "$out/driver.gen"
+
+"$PROFDATA" merge -o "$out/hot.profdata" "$out/hot.profraw"
+
+"$YC" -O2 --profile-use="$out/hot.profdata" --emit=llvm-ir "$dir/hot.yc" "$out/hot.ll"
+"$YC" -O2 --profile-use="$out/hot.profdata" "$dir/hot.yc" "$out/hot.o"
+"$CC" "$dir/driver.c" "$out/hot.o" -o "$out/driver"
+"$out/driver"
+
+if ! grep -q 'branch_weights' "$out/hot.ll"; then
+    echo "run_pgo.sh: no branch weights in $out/hot.ll" >&2
+    exit 1
+fi
+echo "run_pgo.sh: profile applied, branch weights in $out/hot.ll"
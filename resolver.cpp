@@ -0,0 +1,254 @@
+#include "resolver.h"
+#include "tools.h"
+#include "builtins.h"
+#include "compiler_state.h"
+
+using namespace std;
+
+void Resolver::Error(NodeId id, const char *message) {
+    kState->diags.set_location(ast_.node(id).offset);
+    LogError(message);
+    ok_ = false;
+}
+
+void Resolver::Declare(NameId name) {
+    shadowed_.push_back(make_pair(name, bindings_[name]));
+    bindings_[name] = num_slots_++;
+}
+
+void Resolver::Bind(NodeId id, NameId name, bool store) {
+    uint32_t slot = bindings_[name];
+    if (slot == kNoSlot) {
+        const GlobalDecl *global = FindGlobal(name);
+        if (!global) {
+            Error(id, "Unknown variable name");
+            return;
+        }
+        if (global->size)
+            Error(id, "array used without an index");
+        else if (store && global->is_const)
+            Error(id, "cannot assign to a constant");
+        slot = kGlobalSlot;
+    }
+    resolution_.slots_[id] = slot;
+}
+
+const GlobalDecl *Resolver::FindGlobal(NameId name) const {
+    if (bindings_[name] != kNoSlot)
+        return nullptr;
+    auto gi = kState->globals.find(ast_.name(name).str());
+    return gi == kState->globals.end() ? nullptr : &gi->second;
+}
+
+bool Resolver::CheckDeclaration(NodeId id, llvm::StringRef name, size_t num_args, bool definition) {
+    if (kState->globals.count(name.str())) {
+        Error(id, "Function conflicts with a global of the same name");
+        return false;
+    }
+    llvm::Function *f = kState->the_module->getFunction(name);
+    if (!f)
+        return true;
+    if (definition && !f->empty()) {
+        Error(id, "Function cannot be redefined.");
+        return false;
+    }
+    if (f->arg_size() != num_args) {
+        Error(id, "Function redeclared with a different number of arguments");
+        return false;
+    }
+    return true;
+}
+
+bool Resolver::IsConstantExpr(NodeId id) const {
+    const AstNode &node = ast_.node(id);
+    switch (node.kind) {
+    case kNodeNumber:
+        return true;
+    case kNodeVariable: {
+        // earlier constants fold too
+        const GlobalDecl *global = FindGlobal(node.a);
+        return global && global->is_const && !global->size;
+    }
+    case kNodeUnary:
+        return IsConstantExpr(node.a);
+    case kNodeBinary:
+        return node.op != '=' && IsConstantExpr(node.a) && IsConstantExpr(node.b);
+    case kNodeCall: {
+        // builtins fold as the C library computes them
+        if (!GetBuiltin(ast_.name(node.a)))
+            return false;
+        for (NodeId arg : ast_.list(node.b)) {
+            if (!IsConstantExpr(arg))
+                return false;
+        }
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+bool Resolver::ResolveGlobal(NodeId id) {
+    const AstNode &node = ast_.node(id);
+    llvm::StringRef name = ast_.name(node.a);
+    llvm::GlobalVariable *gv = kState->the_module->getGlobalVariable(name);
+    if (gv && !gv->isDeclarationForLinker()) {
+        Error(id, "Global cannot be redefined.");
+        return false;
+    }
+    if (kState->function_protos.count(name.str()) || kState->the_module->getFunction(name)) {
+        Error(id, "Global conflicts with a function of the same name");
+        return false;
+    }
+    if (node.c && !(node.flags & kGlobalConst))
+        Error(id, "only constant arrays are supported");
+
+    llvm::ArrayRef<NodeId> init = ast_.list(node.b);
+    if (node.c && init.size() > node.c)
+        Error(id, "too many initializers for the array");
+    for (NodeId item : init) {
+        if (!IsConstantExpr(item))
+            Error(item, "global initializer must be a constant expression");
+        else
+            Visit(item);
+    }
+    return ok_;
+}
+
+bool Resolver::Resolve(NodeId top_level) {
+    resolution_.slots_.resize(ast_.size(), kNoSlot);
+    bindings_.assign(ast_.num_names(), kNoSlot);
+    shadowed_.clear();
+    num_slots_ = 0;
+    ok_ = true;
+    function_name_ = kNoName;
+
+    const AstNode &node = ast_.node(top_level);
+    if (node.kind == kNodeGlobal)
+        return ResolveGlobal(top_level);
+
+    NodeId proto = node.kind == kNodeFunction ? node.a : top_level;
+    NameId name = ast_.node(proto).a;
+    llvm::ArrayRef<NameId> args = ast_.list(ast_.node(proto).b);
+    if (!CheckDeclaration(top_level, ast_.name(name), args.size(), node.kind == kNodeFunction))
+        return false;
+    if (node.kind != kNodeFunction)
+        return true;
+
+    function_name_ = name;
+    function_arity_ = args.size();
+    for (NameId arg : args)
+        Declare(arg);
+    Visit(node.b);
+    resolution_.slots_[top_level] = num_slots_;
+    return ok_;
+}
+
+void Resolver::VisitVariable(NodeId id) {
+    Bind(id, ast_.node(id).a, false);
+}
+
+void Resolver::VisitBinary(NodeId id) {
+    const AstNode &node = ast_.node(id);
+    switch (node.op) {
+    case '=':
+        if (ast_.kind(node.a) != kNodeVariable) {
+            Error(id, "destination of '=' must be a variable");
+            return;
+        }
+        Bind(node.a, ast_.node(node.a).a, true);
+        Visit(node.b);
+        return;
+    case '+':
+    case '-':
+    case '*':
+    case '/':
+    case '<':
+    case '>':
+    case kOpLessEqual:
+    case kOpGreaterEqual:
+    case kOpEqual:
+    case kOpNotEqual:
+    case kOpAnd:
+    case kOpOr:
+        break;
+    default:
+        Error(id, "invalid binary operator");
+        return;
+    }
+    VisitChildren(id);
+}
+
+void Resolver::VisitUnary(NodeId id) {
+    if (ast_.node(id).op != '!') {
+        Error(id, "invalid unary operator");
+        return;
+    }
+    VisitChildren(id);
+}
+
+void Resolver::VisitCall(NodeId id) {
+    const AstNode &node = ast_.node(id);
+    size_t num_args = ast_.list(node.b).size();
+
+    size_t arity;
+    if (node.a == function_name_) {
+        arity = function_arity_;
+    } else if (const Builtin *builtin = GetBuiltin(ast_.name(node.a))) {
+        arity = builtin->arity;
+    } else {
+        auto fi = kState->function_protos.find(ast_.name(node.a));
+        if (fi == kState->function_protos.end()) {
+            Error(id, "Unknown function referenced");
+            return;
+        }
+        arity = fi->second.args.size();
+    }
+    if (num_args != arity)
+        Error(id, "Incorrect # arguments passed");
+
+    VisitChildren(id);
+}
+
+void Resolver::VisitIndex(NodeId id) {
+    const AstNode &node = ast_.node(id);
+    const GlobalDecl *global = FindGlobal(node.a);
+    if (!global || !global->size) {
+        Error(id, bindings_[node.a] == kNoSlot && !global ? "Unknown array name"
+                                                           : "subscripted value is not an array");
+    } else if (ast_.kind(node.b) == kNodeNumber) {
+        // other indexes are not checked, as in C
+        double index = ast_.number(node.b);
+        if (!(index >= 0 && index < global->size) || index != uint32_t(index))
+            Error(node.b, "array index out of bounds");
+    }
+    Visit(node.b);
+}
+
+void Resolver::VisitAssignment(NodeId id) {
+    const AstNode &node = ast_.node(id);
+    Visit(node.b);
+    Bind(id, node.a, true);
+}
+
+void Resolver::VisitCompound(NodeId id) {
+    const AstNode &node = ast_.node(id);
+    size_t scope_start = shadowed_.size();
+    resolution_.slots_[id] = num_slots_;
+
+    // an initializer still sees the outer variable of its name
+    llvm::ArrayRef<uint32_t> vars = ast_.list(node.a);
+    for (size_t i = 0; i + 1 < vars.size(); i += 2) {
+        if (vars[i + 1] != kNoNode)
+            Visit(vars[i + 1]);
+        Declare(vars[i]);
+    }
+    for (NodeId stat : ast_.list(node.b))
+        Visit(stat);
+
+    // back to the bindings of the enclosing scope
+    while (shadowed_.size() > scope_start) {
+        bindings_[shadowed_.back().first] = shadowed_.back().second;
+        shadowed_.pop_back();
+    }
+}
@@ -0,0 +1,88 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include "ast_visitor.h"
+
+// the node does not refer to a variable
+const uint32_t kNoSlot = ~uint32_t(0);
+// the node refers to a global of kState->globals, by its name
+const uint32_t kGlobalSlot = kNoSlot - 1;
+// no name of an Ast
+const NameId kNoName = ~NameId(0);
+
+/// Resolution - the variables of an Ast bound to slots by Resolver. The
+/// slots of a function are numbered from 0, its arguments first, so code
+/// generation keeps the variables of a function in an array.
+///
+/// Indexed by NodeId it holds
+///   kNodeVariable, kNodeAssignment  the slot of the variable, or
+///                                   kGlobalSlot
+///   kNodeCompound                   the slot of its first variable, the
+///                                   others follow in order
+///   kNodeFunction                   the number of slots of the function
+///   any other node                  kNoSlot
+/// It only depends on the Ast and the prototypes and globals in scope, so
+/// the same Resolution serves any number of code generation runs.
+class Resolution {
+private:
+    std::vector<uint32_t> slots_;
+
+    friend class Resolver;
+public:
+    uint32_t slot(NodeId id) const { return slots_[id]; }
+    uint32_t num_slots(NodeId function) const { return slots_[function]; }
+};
+
+/// Resolver - binds the names of a top-level node to slots and checks it
+/// before any code is generated: every variable is declared, every callee
+/// known and called with the right number of arguments, '=' assigns to a
+/// variable that is not a constant, and no function or global is defined
+/// twice in one module. All errors are reported, each at the node it is
+/// found at.
+class Resolver : public AstVisitor<Resolver> {
+private:
+    Resolution &resolution_;
+    bool ok_ = true;
+    // the slot each name is bound to, kNoSlot if it is not in scope
+    std::vector<uint32_t> bindings_;
+    // (name, outer binding) of the bindings in scope, to undo them at the
+    // end of their compound
+    std::vector<std::pair<NameId, uint32_t>> shadowed_;
+    uint32_t num_slots_ = 0;
+    // the function being resolved, it may call itself; kNoName in a global
+    NameId function_name_ = kNoName;
+    size_t function_arity_ = 0;
+
+    void Error(NodeId id, const char *message);
+    // bind name to the next slot
+    void Declare(NameId name);
+    // the slot name is bound to at node id, store if it is assigned to
+    void Bind(NodeId id, NameId name, bool store);
+    // the global name refers to if no variable shadows it, or nullptr
+    const GlobalDecl *FindGlobal(NameId name) const;
+    // a declaration of name with num_args arguments agrees with the module
+    bool CheckDeclaration(NodeId id, llvm::StringRef name, size_t num_args, bool definition);
+    // initializers of globals are folded before any code runs
+    bool IsConstantExpr(NodeId id) const;
+    bool ResolveGlobal(NodeId id);
+public:
+    Resolver(const Ast &ast, Resolution &resolution) : AstVisitor(ast), resolution_(resolution) {}
+
+    // Resolve a kNodeFunction, an extern kNodePrototype or a kNodeGlobal,
+    // against the prototypes and globals in kState. False if an error was
+    // reported.
+    bool Resolve(NodeId top_level);
+
+    void VisitVariable(NodeId id);
+    void VisitUnary(NodeId id);
+    void VisitBinary(NodeId id);
+    void VisitCall(NodeId id);
+    void VisitIndex(NodeId id);
+    void VisitAssignment(NodeId id);
+    void VisitCompound(NodeId id);
+};
+
+#endif
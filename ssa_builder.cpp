@@ -0,0 +1,120 @@
+#include "ssa_builder.h"
+#include <llvm-9/llvm/IR/CFG.h>
+#include <llvm-9/llvm/IR/Constants.h>
+
+using namespace llvm;
+
+void SsaBuilder::Reset() {
+    var_types_.clear();
+    var_names_.clear();
+    current_def_.clear();
+    sealed_.clear();
+    incomplete_.clear();
+}
+
+unsigned SsaBuilder::NewVariable(Type *type, const std::string &name) {
+    var_types_.push_back(type);
+    var_names_.push_back(name);
+    current_def_.emplace_back();
+    return var_types_.size() - 1;
+}
+
+void SsaBuilder::WriteVariable(unsigned var, BasicBlock *block, Value *val) {
+    current_def_[var][block] = val;
+}
+
+Value *SsaBuilder::ReadVariable(unsigned var, BasicBlock *block) {
+    // local value numbering
+    auto it = current_def_[var].find(block);
+    if (it != current_def_[var].end() && it->second)
+        return it->second;
+    // global value numbering
+    return ReadVariableRecursive(var, block);
+}
+
+PHINode *SsaBuilder::CreatePhi(unsigned var, BasicBlock *block) {
+    // phis go in front of everything else in the block
+    if (block->empty())
+        return PHINode::Create(var_types_[var], 0, var_names_[var], block);
+    return PHINode::Create(var_types_[var], 0, var_names_[var], &block->front());
+}
+
+Value *SsaBuilder::ReadVariableRecursive(unsigned var, BasicBlock *block) {
+    Value *val;
+    if (!sealed_.count(block)) {
+        // more predecessors to come, SealBlock fills in the operands
+        PHINode *phi = CreatePhi(var, block);
+        incomplete_[block].push_back({var, phi});
+        val = phi;
+    } else if (BasicBlock *pred = block->getSinglePredecessor()) {
+        // no phi needed
+        val = ReadVariable(var, pred);
+    } else {
+        // break cycles with an operandless phi
+        PHINode *phi = CreatePhi(var, block);
+        WriteVariable(var, block, phi);
+        val = AddPhiOperands(var, phi);
+    }
+    WriteVariable(var, block, val);
+    return val;
+}
+
+Value *SsaBuilder::AddPhiOperands(unsigned var, PHINode *phi) {
+    // Read all operands before adding any. A read can remove phis that
+    // become trivial, which must not see this one half filled. The handles
+    // follow the values those removals replace.
+    BasicBlock *block = phi->getParent();
+    SmallVector<BasicBlock *, 4> preds(pred_begin(block), pred_end(block));
+    SmallVector<WeakTrackingVH, 4> vals;
+    for (BasicBlock *pred : preds)
+        vals.push_back(ReadVariable(var, pred));
+
+    for (unsigned i = 0, e = preds.size(); i != e; ++i)
+        phi->addIncoming(vals[i], preds[i]);
+    return TryRemoveTrivialPhi(phi);
+}
+
+Value *SsaBuilder::TryRemoveTrivialPhi(PHINode *phi) {
+    Value *same = nullptr;
+    for (Value *op : phi->incoming_values()) {
+        // unique value or self reference
+        if (op == same || op == phi)
+            continue;
+        // the phi merges at least two values
+        if (same)
+            return phi;
+        same = op;
+    }
+    // unreachable or in the entry block
+    if (!same)
+        same = UndefValue::get(phi->getType());
+
+    // Removing phi can make the phis using it trivial in turn. Those can
+    // include same, so keep following it.
+    SmallVector<WeakVH, 8> users;
+    for (User *user : phi->users())
+        if (user != phi && isa<PHINode>(user))
+            users.push_back(user);
+    WeakTrackingVH result = same;
+
+    phi->replaceAllUsesWith(same);
+    phi->eraseFromParent();
+
+    for (auto &user : users)
+        if (auto *user_phi = dyn_cast_or_null<PHINode>(user))
+            TryRemoveTrivialPhi(user_phi);
+    return result;
+}
+
+void SsaBuilder::SealBlock(BasicBlock *block) {
+    // Sealed first, a read reaching block from here on builds a complete phi.
+    sealed_.insert(block);
+
+    auto it = incomplete_.find(block);
+    if (it == incomplete_.end())
+        return;
+    auto phis = std::move(it->second);
+    incomplete_.erase(it);
+    for (auto &incomplete : phis)
+        AddPhiOperands(incomplete.var, incomplete.phi);
+}
@@ -0,0 +1,58 @@
+#ifndef SSA_BUILDER_H
+#define SSA_BUILDER_H
+
+#include <string>
+#include <vector>
+#include <llvm-9/llvm/ADT/DenseMap.h>
+#include <llvm-9/llvm/ADT/SmallPtrSet.h>
+#include <llvm-9/llvm/ADT/SmallVector.h>
+#include <llvm-9/llvm/IR/BasicBlock.h>
+#include <llvm-9/llvm/IR/Instructions.h>
+#include <llvm-9/llvm/IR/Type.h>
+#include <llvm-9/llvm/IR/Value.h>
+#include <llvm-9/llvm/IR/ValueHandle.h>
+
+/// SsaBuilder - builds SSA form for the variables of one function while its
+/// code is generated, after Braun et al., "Simple and Efficient Construction
+/// of Static Single Assignment Form".
+///
+/// A write records the value of a variable at the end of a block, a read
+/// looks it up through the predecessors and places phis where paths merge.
+/// A block is sealed once all its predecessors branch to it. Reads in a
+/// block that is not sealed yet get an incomplete phi, whose operands are
+/// added by SealBlock. Phis that turn out to merge only one value are
+/// removed again, so no alloca, load or store is generated for variables.
+class SsaBuilder {
+private:
+    struct IncompletePhi {
+        unsigned var;
+        llvm::PHINode *phi;
+    };
+
+    std::vector<llvm::Type *> var_types_;
+    // phis are named after their variable
+    std::vector<std::string> var_names_;
+    // var -> block -> the value of var at the end of block
+    std::vector<llvm::DenseMap<llvm::BasicBlock *, llvm::WeakTrackingVH>> current_def_;
+    llvm::SmallPtrSet<llvm::BasicBlock *, 16> sealed_;
+    llvm::DenseMap<llvm::BasicBlock *, llvm::SmallVector<IncompletePhi, 4>> incomplete_;
+
+    llvm::PHINode *CreatePhi(unsigned var, llvm::BasicBlock *block);
+    llvm::Value *ReadVariableRecursive(unsigned var, llvm::BasicBlock *block);
+    llvm::Value *AddPhiOperands(unsigned var, llvm::PHINode *phi);
+    llvm::Value *TryRemoveTrivialPhi(llvm::PHINode *phi);
+public:
+    // Forget all variables and blocks, for the next function.
+    void Reset();
+
+    // A new variable, not defined in any block yet.
+    unsigned NewVariable(llvm::Type *type, const std::string &name);
+
+    void WriteVariable(unsigned var, llvm::BasicBlock *block, llvm::Value *val);
+    llvm::Value *ReadVariable(unsigned var, llvm::BasicBlock *block);
+
+    // No more predecessors will be added to block.
+    void SealBlock(llvm::BasicBlock *block);
+};
+
+#endif
@@ -0,0 +1,223 @@
+#include "tiered_jit.h"
+#include "backend.h"
+#include "compiler_state.h"
+#include <iostream>
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+using namespace std;
+
+// Entered by tier 0 code when a count reaches the threshold.
+static void TierUp(TieredJit::Profile *profile) {
+    profile->owner->Enqueue(profile);
+}
+
+static vector<llvm::CallInst *> CountMarks(llvm::Function &f) {
+    vector<llvm::CallInst *> marks;
+    for (auto &bb : f)
+        for (auto &inst : bb)
+            if (auto *call = llvm::dyn_cast<llvm::CallInst>(&inst))
+                if (call->getCalledFunction() &&
+                    call->getCalledFunction()->getName() == kTierCountMarker)
+                    marks.push_back(call);
+    return marks;
+}
+
+void DropCountMarks(llvm::Function &f) {
+    for (auto *mark : CountMarks(f))
+        mark->eraseFromParent();
+}
+
+static void DropCountMarks(llvm::Module &module) {
+    for (auto &f : module)
+        DropCountMarks(f);
+    if (auto *marker = module.getFunction(kTierCountMarker))
+        marker->eraseFromParent();
+}
+
+TieredJit::TieredJit(llvm::orc::KaleidoscopeJIT &jit, uint64_t threshold)
+    : jit_(jit), threshold_(threshold) {
+    // only used for the analyses of the -O3 pipeline, the JIT generates code
+    target_machine_.reset(llvm::EngineBuilder().setMCPU(llvm::sys::getHostCPUName()).selectTarget());
+    worker_ = thread(&TieredJit::Run, this);
+}
+
+TieredJit::~TieredJit() {
+    {
+        lock_guard<mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cond_.notify_all();
+    worker_.join();
+}
+
+TieredJit::Profile *TieredJit::InstrumentFunction(llvm::Function *f) {
+    auto *module = f->getParent();
+    auto &context = module->getContext();
+    string name = f->getName().str();
+
+    profiles_.push_back(make_unique<Profile>());
+    Profile *profile = profiles_.back().get();
+    profile->name = name;
+    profile->owner = this;
+
+    // Tier 1 starts from f without counters and with the local functions
+    // it may call, e.g. specializations, everything else declared.
+    {
+        llvm::ValueToValueMapTy vmap;
+        auto copy = llvm::CloneModule(*module, vmap, [f](const llvm::GlobalValue *gv) {
+            return gv == f || gv->hasLocalLinkage();
+        });
+        DropCountMarks(*copy);
+        llvm::raw_string_ostream os(profile->bitcode);
+        llvm::WriteBitcodeToFile(*copy, os);
+    }
+
+    // count = count + 1; if (count >= threshold) TierUp(profile);
+    // Racing increments can skip any one value, queued keeps TierUp from
+    // queuing f again.
+    auto *i64_ty = llvm::Type::getInt64Ty(context);
+    auto *i8_ptr_ty = llvm::Type::getInt8PtrTy(context);
+    auto *counter = llvm::ConstantExpr::getIntToPtr(
+        llvm::ConstantInt::get(i64_ty, (uint64_t)&profile->count), i64_ty->getPointerTo());
+    auto *tier_up_ty = llvm::FunctionType::get(llvm::Type::getVoidTy(context), {i8_ptr_ty}, false);
+    auto *tier_up = llvm::ConstantExpr::getIntToPtr(
+        llvm::ConstantInt::get(i64_ty, (uint64_t)&TierUp), tier_up_ty->getPointerTo());
+    auto *profile_arg = llvm::ConstantExpr::getIntToPtr(
+        llvm::ConstantInt::get(i64_ty, (uint64_t)profile), i8_ptr_ty);
+    auto *unlikely = llvm::MDBuilder(context).createBranchWeights(1, 1 << 20);
+
+    for (auto *mark : CountMarks(*f)) {
+        llvm::IRBuilder<> builder(mark);
+        auto *count = builder.CreateAdd(builder.CreateLoad(i64_ty, counter), builder.getInt64(1));
+        builder.CreateStore(count, counter);
+        auto *hot = builder.CreateICmpUGE(count, builder.getInt64(threshold_));
+        auto *then = llvm::SplitBlockAndInsertIfThen(hot, mark, false, unlikely);
+        builder.SetInsertPoint(then);
+        builder.CreateCall(tier_up_ty, tier_up, {profile_arg});
+        mark->eraseFromParent();
+    }
+
+    // Calls to f, recursive ones too, go through the stub from now on.
+    f->setName(name + ".tier0");
+    auto *stub = llvm::Function::Create(f->getFunctionType(), llvm::Function::ExternalLinkage,
+                                        name, module);
+    f->replaceAllUsesWith(stub);
+    return profile;
+}
+
+llvm::orc::VModuleKey TieredJit::AddModule(unique_ptr<llvm::Module> module, bool tier) {
+    vector<Profile *> added;
+    if (tier) {
+        vector<llvm::Function *> fs;
+        // local functions are not in the symbol table, they get no stub
+        for (auto &f : *module)
+            if (!f.isDeclaration() && !f.hasLocalLinkage() && !CountMarks(f).empty())
+                fs.push_back(&f);
+        for (auto *f : fs)
+            added.push_back(InstrumentFunction(f));
+    }
+    DropCountMarks(*module);
+
+    // The stubs have to resolve before the module is linked, they are
+    // published once they point at tier 0. Stubs of redefined functions
+    // are published already and keep their old target until then.
+    for (auto *profile : added)
+        jit_.createStub(profile->name, 0, false);
+
+    auto key = jit_.addModule(move(module), true);
+
+    lock_guard<mutex> lock(mutex_);
+    for (auto *profile : added) {
+        auto symbol = jit_.findSymbol(profile->name + ".tier0");
+        if (!symbol) {
+            kState->diags.Error("tier 0 of " + profile->name + ": symbol not found");
+            jit_.removeStub(profile->name);
+            continue;
+        }
+        jit_.updateStub(profile->name, llvm::cantFail(symbol.getAddress()));
+        jit_.publishStub(profile->name);
+        current_[profile->name] = profile;
+    }
+    return key;
+}
+
+void TieredJit::Enqueue(Profile *profile) {
+    if (profile->queued.exchange(true))
+        return;
+    {
+        lock_guard<mutex> lock(mutex_);
+        queue_.push_back(profile);
+    }
+    cond_.notify_all();
+}
+
+void TieredJit::Flush() {
+    unique_lock<mutex> lock(mutex_);
+    cond_.wait(lock, [this]() { return queue_.empty() && !busy_; });
+}
+
+void TieredJit::Recompile(Profile *profile) {
+    // a context of its own, the compiler thread shares no IR with the others
+    llvm::LLVMContext context;
+    auto module = llvm::parseBitcodeFile(
+        llvm::MemoryBufferRef(profile->bitcode, profile->name), context);
+    if (!module) {
+        cerr << "tier 1 of " << profile->name << ": "
+             << llvm::toString(module.takeError()) << endl;
+        return;
+    }
+
+    // keeps direct recursion, other callers come through the stub
+    (*module)->getFunction(profile->name)->setName(profile->name + ".tier1");
+
+    BackendOptions options;
+    options.opt_level = 3;
+    PrepareModule(**module, *target_machine_);
+    OptimizeModule(**module, *target_machine_, options, false);
+
+    jit_.addModule(move(*module));
+    auto symbol = jit_.findSymbol(profile->name + ".tier1");
+    if (!symbol) {
+        cerr << "tier 1 of " << profile->name << ": symbol not found" << endl;
+        return;
+    }
+    auto address = symbol.getAddress();
+    if (!address) {
+        cerr << "tier 1 of " << profile->name << ": " << llvm::toString(address.takeError()) << endl;
+        return;
+    }
+
+    lock_guard<mutex> lock(mutex_);
+    if (current_[profile->name] != profile)
+        return;
+    jit_.updateStub(profile->name, *address);
+    ++num_tier_ups_;
+}
+
+void TieredJit::Run() {
+    unique_lock<mutex> lock(mutex_);
+    while (true) {
+        cond_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+        if (stop_)
+            return;
+
+        Profile *profile = queue_.front();
+        queue_.pop_front();
+        busy_ = true;
+        lock.unlock();
+
+        Recompile(profile);
+
+        lock.lock();
+        busy_ = false;
+        cond_.notify_all();
+    }
+}
@@ -0,0 +1,89 @@
+#ifndef TIERED_JIT_H
+#define TIERED_JIT_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Target/TargetMachine.h"
+#include "KaleidoscopeJIT.h"
+
+// Calls plus loop iterations after which a definition is recompiled.
+const uint64_t kDefaultTierUpThreshold = 10000;
+
+// Code generation marks the places to count with calls to this function,
+// see EmitTierCount.
+const char kTierCountMarker[] = "yc.tier.count";
+
+// Remove the marks of f, e.g. of a copy that is not counted on its own.
+void DropCountMarks(llvm::Function &f);
+
+/// TieredJit - runs definitions as -O0 FastISel code first (tier 0) and
+/// replaces the hot ones by -O3 code (tier 1), compiled on a background
+/// thread.
+///
+/// Every definition f is called through an indirection stub named f. Its
+/// tier 0 body f.tier0 counts calls and loop iterations, once the count
+/// reaches the threshold f is queued for tier 1. The tier 1 body f.tier1 is
+/// built from a copy of f taken before the counters went in, and the stub
+/// is then pointed at it. Frames already running in f.tier0 stay there.
+class TieredJit {
+public:
+    struct Profile {
+        // bumped by tier 0 code without synchronization, increments can be lost
+        uint64_t count = 0;
+        std::atomic<bool> queued{false};
+        std::string name;
+        // bitcode of f without counters
+        std::string bitcode;
+        TieredJit *owner;
+    };
+
+    TieredJit(llvm::orc::KaleidoscopeJIT &jit, uint64_t threshold = kDefaultTierUpThreshold);
+    ~TieredJit();
+
+    // Add module as tier 0 code. With tier, each definition holding counter
+    // marks gets a stub and a profile, otherwise the marks are dropped.
+    llvm::orc::VModuleKey AddModule(std::unique_ptr<llvm::Module> module, bool tier = true);
+
+    // Queue a profile for tier 1, called by tier 0 code.
+    void Enqueue(Profile *profile);
+
+    // Block until the queue is empty and no compile is running.
+    void Flush();
+
+    // definitions recompiled so far
+    unsigned num_tier_ups() const { return num_tier_ups_; }
+
+private:
+    llvm::orc::KaleidoscopeJIT &jit_;
+    uint64_t threshold_;
+    std::vector<std::unique_ptr<Profile>> profiles_;
+    std::unique_ptr<llvm::TargetMachine> target_machine_;
+
+    // guards the members below and the stub targets
+    std::mutex mutex_;
+    // the profile of the newest definition of each name, a redefined
+    // function must not be replaced by tier 1 of its old body
+    std::map<std::string, Profile *> current_;
+    std::condition_variable cond_;
+    std::deque<Profile *> queue_;
+    bool busy_ = false;
+    bool stop_ = false;
+    std::atomic<unsigned> num_tier_ups_{0};
+    std::thread worker_;
+
+    Profile *InstrumentFunction(llvm::Function *f);
+    void Recompile(Profile *profile);
+    void Run();
+};
+
+#endif
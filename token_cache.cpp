@@ -0,0 +1,131 @@
+#include "token_cache.h"
+#include "lexer.h"
+#include <cstring>
+#include <llvm-9/llvm/Support/FileSystem.h>
+#include <llvm-9/llvm/Support/raw_ostream.h>
+#include <llvm-9/llvm/Support/xxhash.h>
+
+using namespace std;
+
+uint64_t HashSource(llvm::StringRef source) {
+    return llvm::xxHash64(source);
+}
+
+static size_t AlignTo8(size_t n) {
+    return (n + 7) & ~size_t(7);
+}
+
+unique_ptr<TokenCache> TokenCache::Open(const string &cache_path, llvm::StringRef source) {
+    // Large files are mmapped by MemoryBuffer, nothing is copied.
+    auto buffer_or_err = llvm::MemoryBuffer::getFile(cache_path, -1, false);
+    if (!buffer_or_err)
+        return nullptr;
+
+    unique_ptr<TokenCache> cache(new TokenCache(move(*buffer_or_err)));
+    const char *start = cache->buffer_->getBufferStart();
+    size_t size = cache->buffer_->getBufferSize();
+
+    if (size < sizeof(TokenCacheHeader))
+        return nullptr;
+    auto *header = reinterpret_cast<const TokenCacheHeader *>(start);
+    if (memcmp(header->magic, kTokenCacheMagic, sizeof(kTokenCacheMagic)) != 0 ||
+        header->version != kTokenCacheVersion)
+        return nullptr;
+
+    // stale cache
+    if (header->source_size != source.size() ||
+        header->source_hash != HashSource(source))
+        return nullptr;
+
+    size_t tokens_at = sizeof(TokenCacheHeader);
+    size_t numbers_at = AlignTo8(tokens_at + size_t(header->num_tokens) * sizeof(CachedToken));
+    size_t idents_at = numbers_at + size_t(header->num_numbers) * sizeof(double);
+    size_t chars_at = idents_at + (size_t(header->num_idents) + 1) * sizeof(uint32_t);
+    if (chars_at + header->ident_bytes != size)
+        return nullptr;
+
+    cache->header_ = header;
+    cache->tokens_ = reinterpret_cast<const CachedToken *>(start + tokens_at);
+    cache->numbers_ = start + numbers_at;
+    cache->ident_offsets_ = reinterpret_cast<const uint32_t *>(start + idents_at);
+    cache->ident_chars_ = start + chars_at;
+
+    // Check operands once so that replay needs no bounds checks.
+    for (uint32_t i = 0; i != header->num_idents; ++i)
+        if (cache->ident_offsets_[i] > cache->ident_offsets_[i + 1])
+            return nullptr;
+    if (cache->ident_offsets_[header->num_idents] != header->ident_bytes)
+        return nullptr;
+    for (uint32_t i = 0; i != header->num_tokens; ++i) {
+        const CachedToken &tok = cache->tokens_[i];
+        if ((tok.kind == kTokIdentifier && tok.operand >= header->num_idents) ||
+            (tok.kind == kTokNumber && tok.operand >= header->num_numbers))
+            return nullptr;
+    }
+
+    return cache;
+}
+
+double TokenCache::number(uint32_t i) const {
+    double val;
+    memcpy(&val, numbers_ + i * sizeof(double), sizeof(double));
+    return val;
+}
+
+void TokenCacheWriter::AddToken(int kind, unsigned offset, llvm::StringRef identifier, double num_val) {
+    CachedToken tok = {kind, offset, 0};
+
+    if (kind == kTokIdentifier) {
+        // intern the identifier
+        auto inserted = ident_ids_.insert(make_pair(identifier, uint32_t(ident_offsets_.size() - 1)));
+        if (inserted.second) {
+            ident_chars_ += identifier;
+            ident_offsets_.push_back(ident_chars_.size());
+        }
+        tok.operand = inserted.first->second;
+    } else if (kind == kTokNumber) {
+        tok.operand = numbers_.size();
+        numbers_.push_back(num_val);
+    }
+
+    tokens_.push_back(tok);
+}
+
+bool TokenCacheWriter::Write(const string &cache_path, llvm::StringRef source) {
+    TokenCacheHeader header;
+    memcpy(header.magic, kTokenCacheMagic, sizeof(kTokenCacheMagic));
+    header.version = kTokenCacheVersion;
+    header.source_hash = HashSource(source);
+    header.source_size = source.size();
+    header.num_tokens = tokens_.size();
+    header.num_numbers = numbers_.size();
+    header.num_idents = ident_offsets_.size() - 1;
+    header.ident_bytes = ident_chars_.size();
+
+    // Write to a temporary and rename, so readers never see a partial file.
+    string tmp_path = cache_path + ".tmp";
+    {
+        error_code ec;
+        llvm::raw_fd_ostream out(tmp_path, ec, llvm::sys::fs::OF_None);
+        if (ec)
+            return false;
+
+        size_t tokens_end = sizeof(header) + tokens_.size() * sizeof(CachedToken);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char *>(tokens_.data()), tokens_.size() * sizeof(CachedToken));
+        static const char kPadding[8] = {};
+        out.write(kPadding, AlignTo8(tokens_end) - tokens_end);
+        out.write(reinterpret_cast<const char *>(numbers_.data()), numbers_.size() * sizeof(double));
+        out.write(reinterpret_cast<const char *>(ident_offsets_.data()), ident_offsets_.size() * sizeof(uint32_t));
+        out << ident_chars_;
+
+        out.close();
+        if (out.has_error()) {
+            out.clear_error();
+            llvm::sys::fs::remove(tmp_path);
+            return false;
+        }
+    }
+
+    return !llvm::sys::fs::rename(tmp_path, cache_path);
+}
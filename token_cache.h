@@ -0,0 +1,89 @@
+#ifndef TOKEN_CACHE_H
+#define TOKEN_CACHE_H
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <llvm-9/llvm/ADT/StringMap.h>
+#include <llvm-9/llvm/ADT/StringRef.h>
+#include <llvm-9/llvm/Support/MemoryBuffer.h>
+
+// Pre-tokenized source cache (".ytc" file written next to a source).
+//
+// Layout, all fields in host byte order:
+//   TokenCacheHeader
+//   CachedToken    tokens[num_tokens]
+//   (padding up to 8 bytes)
+//   double         numbers[num_numbers]
+//   uint32_t       ident_offsets[num_idents + 1]
+//   char           ident_chars[ident_bytes]
+//
+// The header records a hash and the size of the source text, a cache is only
+// used when both match the source it is loaded for.
+
+const char kTokenCacheMagic[4] = {'Y', 'C', 'T', 'C'};
+const uint32_t kTokenCacheVersion = 4;
+
+struct TokenCacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t source_hash;
+    uint64_t source_size;
+    uint32_t num_tokens;
+    uint32_t num_numbers;
+    uint32_t num_idents;
+    uint32_t ident_bytes;
+};
+
+/// CachedToken - one token, operand indexes the identifier table for
+/// kTokIdentifier and the number table for kTokNumber.
+struct CachedToken {
+    int32_t kind;
+    uint32_t offset;
+    uint32_t operand;
+};
+
+uint64_t HashSource(llvm::StringRef source);
+
+/// TokenCache - read-only view of a cache file, tokens are used in place.
+class TokenCache {
+private:
+    std::unique_ptr<llvm::MemoryBuffer> buffer_;
+    const TokenCacheHeader *header_;
+    const CachedToken *tokens_;
+    const char *numbers_;
+    const uint32_t *ident_offsets_;
+    const char *ident_chars_;
+
+    TokenCache(std::unique_ptr<llvm::MemoryBuffer> buffer)
+        : buffer_(std::move(buffer)) {}
+public:
+    // Returns nullptr if the cache is missing, corrupt or stale for source.
+    static std::unique_ptr<TokenCache> Open(const std::string &cache_path,
+                                            llvm::StringRef source);
+
+    uint32_t size() const { return header_->num_tokens; }
+    const CachedToken &token(uint32_t i) const { return tokens_[i]; }
+    double number(uint32_t i) const;
+    llvm::StringRef identifier(uint32_t i) const {
+        return llvm::StringRef(ident_chars_ + ident_offsets_[i],
+                               ident_offsets_[i + 1] - ident_offsets_[i]);
+    }
+};
+
+/// TokenCacheWriter - collects the tokens of one lexer run.
+class TokenCacheWriter {
+private:
+    std::vector<CachedToken> tokens_;
+    std::vector<double> numbers_;
+    llvm::StringMap<uint32_t> ident_ids_;
+    std::vector<uint32_t> ident_offsets_;
+    std::string ident_chars_;
+public:
+    TokenCacheWriter() : ident_offsets_(1, 0) {}
+    void AddToken(int kind, unsigned offset, llvm::StringRef identifier, double num_val);
+    bool Write(const std::string &cache_path, llvm::StringRef source);
+};
+
+#endif
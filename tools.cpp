@@ -1,44 +1,24 @@
 #include "tools.h"
+#include "compiler_state.h"
+#include "codegen.h"
 #include <iostream>
+#include <mutex>
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Scalar/GVN.h"
 #include <llvm-9/llvm/IR/IRBuilder.h>
+#include <llvm-9/llvm/IR/Verifier.h>
 #include <llvm-9/llvm/Transforms/Utils.h>
+#include <llvm-9/llvm/Transforms/Utils/Cloning.h>
+#include <llvm-9/llvm/ADT/StringExtras.h>
 #include "KaleidoscopeJIT.h"
 
-extern llvm::LLVMContext kTheContext;
-extern llvm::IRBuilder<> kBuilder;
-extern std::unique_ptr<llvm::Module> kTheModule; // = std::make_unique<llvm::Module>("my cool jit", kTheContext);
-extern std::map<std::string, llvm::Value *> kNamedValues;
-extern std::unique_ptr<llvm::legacy::FunctionPassManager> kTheFpm;
-extern std::unique_ptr<llvm::orc::KaleidoscopeJIT> kTheJit;// = std::make_unique<llvm::orc::KaleidoscopeJIT>();
-extern std::map<std::string, std::unique_ptr<PrototypeAst>> kFunctionProtos;
 
-
-using std::cerr;
-using std::endl;
-
-std::unique_ptr<ExprAst> LogError(const char *str) {
-    std::cerr << "Error: " << str << std::endl;
-    return nullptr;
-}
-
-std::unique_ptr<PrototypeAst> LogErrorP(const char *str) {
-    LogError(str);
-    return nullptr;
-}
-
-std::unique_ptr<StatAst> LogErrorS(const char *str) {
-    LogError(str);
-    return nullptr;
-}
-
-std::unique_ptr<CompoundStatAst> LogErrorCS(const char *str) {
-    LogError(str);
-    return nullptr;
+NodeId LogError(const char *str) {
+    kState->diags.Error(str);
+    return kNoNode;
 }
 
 llvm::Value *LogErrorV(const char *str) {
@@ -48,40 +28,315 @@ llvm::Value *LogErrorV(const char *str) {
 
 void InitializeModuleAndPassManager() {
     // Open a new module.
-    kTheModule = std::make_unique<llvm::Module>("my niubi jit", kTheContext);
-    kTheModule->setDataLayout(kTheJit->getTargetMachine().createDataLayout());
+    kState->the_module = std::make_unique<llvm::Module>("my niubi jit", kState->the_context);
+    kState->the_module->setDataLayout(kState->the_jit->getTargetMachine().createDataLayout());
 
     // Create a new pass manager attached to it
-    kTheFpm = std::make_unique<llvm::legacy::FunctionPassManager>(kTheModule.get());
+    kState->the_fpm = std::make_unique<llvm::legacy::FunctionPassManager>(kState->the_module.get());
 
 	// Promote allocas to registers.
-    kTheFpm->add(llvm::createPromoteMemoryToRegisterPass());
+    kState->the_fpm->add(llvm::createPromoteMemoryToRegisterPass());
     // Do simple "peephole" optimizations and bit-twiddling optzns.
-	kTheFpm->add(llvm::createInstructionCombiningPass());
+	kState->the_fpm->add(llvm::createInstructionCombiningPass());
 	// Reassociate expressions.
-	kTheFpm->add(llvm::createReassociatePass());
+	kState->the_fpm->add(llvm::createReassociatePass());
 	// Eliminate Common SubExpressions.
-	kTheFpm->add(llvm::createGVNPass());
+	kState->the_fpm->add(llvm::createGVNPass());
 	// Simplify the control flow graph (deleting unreachable blocks, etc).
-	kTheFpm->add(llvm::createCFGSimplificationPass());
+	kState->the_fpm->add(llvm::createCFGSimplificationPass());
+
+	kState->the_fpm->doInitialization();
+}
 
-	kTheFpm->doInitialization();
+static void InitializeNativeTarget() {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::InitializeNativeTargetAsmParser();
+}
+
+void InitializeNativeTargetOnce() {
+    // parsers and sessions may be created on several threads
+    static std::once_flag native_target_initialized;
+    std::call_once(native_target_initialized, InitializeNativeTarget);
+}
+
+void EmitTierCount() {
+    auto marker = kState->the_module->getOrInsertFunction(
+        kTierCountMarker, llvm::Type::getVoidTy(kState->the_context));
+    kState->builder.CreateCall(marker);
 }
 
 llvm::Function *GetFunction(std::string name) {
-    if (auto *f = kTheModule->getFunction(name))
+    if (auto *f = kState->the_module->getFunction(name))
         return f;
 
-    auto fi = kFunctionProtos.find(name);
-    if (fi != kFunctionProtos.end())
-        return fi->second->CodeGen();
+    auto fi = kState->function_protos.find(name);
+    if (fi != kState->function_protos.end())
+        return EmitPrototype(fi->second);
+
+    return nullptr;
+}
+
+llvm::GlobalVariable *GetGlobal(std::string name) {
+    if (auto *gv = kState->the_module->getGlobalVariable(name))
+        return gv;
+
+    auto gi = kState->globals.find(name);
+    if (gi != kState->globals.end())
+        return EmitGlobalDeclaration(gi->second);
 
     return nullptr;
 }
 
+bool AllSymbolsDefined(llvm::Module &module, llvm::Module *defined_in) {
+    bool ok = true;
+    for (auto &gv : module.global_values()) {
+        // tier counters are replaced when the module is added
+        if (!gv.isDeclaration() || gv.use_empty() || gv.getName() == kTierCountMarker)
+            continue;
+        if (auto *f = llvm::dyn_cast<llvm::Function>(&gv))
+            if (f->isIntrinsic())
+                continue;
+
+        std::string name = gv.getName().str();
+        auto *def = defined_in ? defined_in->getNamedValue(name) : nullptr;
+        if ((def && !def->isDeclaration()) || kState->the_jit->findSymbol(name))
+            continue;
+        kState->diags.Error("undefined symbol " + name);
+        ok = false;
+    }
+    return ok;
+}
+
+bool RunTopLevelExprs(std::vector<double> &results) {
+    if (!kState->the_jit)
+        kState->the_jit = std::make_unique<llvm::orc::KaleidoscopeJIT>();
+    auto data_layout = kState->the_jit->getTargetMachine().createDataLayout();
+
+    // New definitions, later sources start a module of their own. A module
+    // of nothing but declarations is kept for the next batch.
+    bool has_definitions = false;
+    if (kState->the_module)
+        for (auto &gv : kState->the_module->global_values())
+            has_definitions |= !gv.isDeclarationForLinker();
+
+    // a batch that refers to an undefined symbol is not run at all
+    bool ok = true;
+    if ((has_definitions && !AllSymbolsDefined(*kState->the_module, nullptr)) ||
+        (kState->expr_module &&
+         !AllSymbolsDefined(*kState->expr_module, has_definitions ? kState->the_module.get() : nullptr))) {
+        if (has_definitions)
+            kState->the_module.reset();
+        has_definitions = false;
+        kState->expr_module.reset();
+        ok = false;
+    }
+
+    if (has_definitions) {
+        kState->the_module->setDataLayout(data_layout);
+        if (kState->tiered_jit)
+            kState->tiered_jit->AddModule(std::move(kState->the_module));
+        else
+            kState->the_jit->addModule(std::move(kState->the_module));
+    }
+
+    if (kState->expr_module) {
+        // all pending expressions are compiled and linked at once
+        kState->expr_module->setDataLayout(data_layout);
+        // run once, not worth optimizing
+        auto key = kState->tiered_jit
+                       ? kState->tiered_jit->AddModule(std::move(kState->expr_module), false)
+                       : kState->the_jit->addModule(std::move(kState->expr_module), true);
+
+        for (auto &name : kState->anon_exprs) {
+            auto symbol = kState->the_jit->findSymbol(name);
+            if (!symbol) {
+                LogError("top-level expression not found in the JIT");
+                ok = false;
+                break;
+            }
+            auto address = symbol.getAddress();
+            if (!address) {
+                LogError(llvm::toString(address.takeError()).c_str());
+                ok = false;
+                break;
+            }
+
+            double (*fp)() = (double (*)())(intptr_t)*address;
+            results.push_back(fp());
+        }
+
+        // gives the code and data pages back to the arena of the JIT
+        kState->the_jit->removeModule(key);
+    }
+
+    for (auto &name : kState->anon_exprs)
+        kState->function_protos.erase(name);
+    kState->anon_exprs.clear();
+    return ok;
+}
+
+// Size of f for inlining, the allocas of the arguments are not counted.
+static unsigned InlineCost(llvm::Function *f) {
+    unsigned cost = 0;
+    for (auto &bb : *f)
+        for (auto &inst : bb)
+            if (!llvm::isa<llvm::AllocaInst>(inst))
+                ++cost;
+    return cost;
+}
+
+// the callee of a call in the function being generated
+static bool IsCallable(llvm::Function *callee) {
+    return !callee->isDeclaration() &&
+           callee != kState->builder.GetInsertBlock()->getParent();
+}
+
+llvm::Function *SpecializeCall(llvm::Function *callee, std::vector<llvm::Value *> &args) {
+    if (!kState->inline_calls || !IsCallable(callee))
+        return callee;
+
+    // f.spec.<bits of the constant>._ for f(1, x)
+    std::string name = callee->getName().str() + ".spec";
+    bool has_constants = false;
+    for (auto *arg : args) {
+        if (auto *c = llvm::dyn_cast<llvm::ConstantFP>(arg)) {
+            name += "." + llvm::utohexstr(c->getValueAPF().bitcastToAPInt().getZExtValue());
+            has_constants = true;
+        } else {
+            name += "._";
+        }
+    }
+    if (!has_constants || InlineCost(callee) > kSpecializeThreshold)
+        return callee;
+
+    auto *spec = kState->the_module->getFunction(name);
+    if (!spec) {
+        // Arguments mapped to a constant are left out of the clone.
+        llvm::ValueToValueMapTy vmap;
+        unsigned i = 0;
+        for (auto &arg : callee->args()) {
+            if (auto *c = llvm::dyn_cast<llvm::ConstantFP>(args[i]))
+                vmap[&arg] = c;
+            ++i;
+        }
+        spec = llvm::CloneFunction(callee, vmap);
+        spec->setName(name);
+        spec->setLinkage(llvm::Function::InternalLinkage);
+
+        // Only the callee is counted for tiered compilation, its clones
+        // are compiled along with their callers.
+        DropCountMarks(*spec);
+
+        // Fold the constants through, whatever -O<n> is.
+        llvm::legacy::FunctionPassManager fpm(kState->the_module.get());
+        fpm.add(llvm::createPromoteMemoryToRegisterPass());
+        fpm.add(llvm::createSCCPPass());
+        fpm.add(llvm::createInstructionCombiningPass());
+        fpm.add(llvm::createCFGSimplificationPass());
+        fpm.doInitialization();
+        fpm.run(*spec);
+        fpm.doFinalization();
+    }
+
+    std::vector<llvm::Value *> rest;
+    for (auto *arg : args)
+        if (!llvm::isa<llvm::ConstantFP>(arg))
+            rest.push_back(arg);
+    args.swap(rest);
+    return spec;
+}
+
+bool ShouldInline(llvm::Function *callee) {
+    return kState->inline_calls && IsCallable(callee) && InlineCost(callee) <= kInlineThreshold;
+}
+
+void InlineSmallCalls(llvm::Function *f) {
+    std::vector<llvm::CallInst *> calls;
+    for (auto &bb : *f)
+        for (auto &inst : bb)
+            if (auto *call = llvm::dyn_cast<llvm::CallInst>(&inst))
+                if (call->hasFnAttr(llvm::Attribute::AlwaysInline))
+                    calls.push_back(call);
+
+    for (auto *call : calls) {
+        auto *callee = call->getCalledFunction();
+        llvm::InlineFunctionInfo ifi;
+        llvm::InlineFunction(call, ifi);
+        // a specialization nobody calls anymore, made again when needed
+        if (callee && callee->hasLocalLinkage() && callee->use_empty())
+            callee->eraseFromParent();
+    }
+}
+
+llvm::Function *CreateMapEntryPoint(llvm::Function *scalar) {
+    auto &context = kState->the_context;
+    auto *double_ty = llvm::Type::getDoubleTy(context);
+    auto *double_ptr_ty = double_ty->getPointerTo();
+    auto *i64_ty = llvm::Type::getInt64Ty(context);
+
+    // out, one array per argument, count
+    std::vector<llvm::Type *> params(scalar->arg_size() + 1, double_ptr_ty);
+    params.push_back(i64_ty);
+    auto *ft = llvm::FunctionType::get(llvm::Type::getVoidTy(context), params, false);
+
+    // '_' is not an identifier character, the name cannot clash with a def
+    std::string name = scalar->getName().str() + "_map";
+    if (kState->the_module->getFunction(name))
+        return (llvm::Function *)LogErrorV("map entry point defined twice");
+    auto *f = llvm::Function::Create(ft, llvm::Function::ExternalLinkage, name, kState->the_module.get());
+
+    // No aliasing between the arrays spares the vectorizer runtime checks.
+    for (unsigned i = 0; i != scalar->arg_size() + 1; ++i) {
+        f->addParamAttr(i, llvm::Attribute::NoAlias);
+        if (i > 0)
+            f->addParamAttr(i, llvm::Attribute::ReadOnly);
+    }
+    auto *out = f->arg_begin();
+    auto *count = f->arg_end() - 1;
+    out->setName("out");
+    count->setName("n");
+    for (unsigned i = 0; i != scalar->arg_size(); ++i)
+        (f->arg_begin() + i + 1)->setName((scalar->arg_begin() + i)->getName());
+
+    // own builder, the insert point of kState->builder is left alone
+    llvm::IRBuilder<> builder(context);
+    auto *entry_bb = llvm::BasicBlock::Create(context, "entry", f);
+    auto *loop_bb = llvm::BasicBlock::Create(context, "loop", f);
+    auto *exit_bb = llvm::BasicBlock::Create(context, "exit", f);
+
+    builder.SetInsertPoint(entry_bb);
+    auto *empty = builder.CreateICmpSLE(count, llvm::ConstantInt::get(i64_ty, 0), "empty");
+    builder.CreateCondBr(empty, exit_bb, loop_bb);
+
+    builder.SetInsertPoint(loop_bb);
+    auto *i = builder.CreatePHI(i64_ty, 2, "i");
+    i->addIncoming(llvm::ConstantInt::get(i64_ty, 0), entry_bb);
+
+    std::vector<llvm::Value *> args;
+    for (unsigned k = 0; k != scalar->arg_size(); ++k) {
+        auto *ptr = builder.CreateInBoundsGEP(double_ty, f->arg_begin() + k + 1, i);
+        args.push_back(builder.CreateLoad(double_ty, ptr));
+    }
+    auto *call = builder.CreateCall(scalar, args, "val");
+    call->addAttribute(llvm::AttributeList::FunctionIndex, llvm::Attribute::AlwaysInline);
+    builder.CreateStore(call, builder.CreateInBoundsGEP(double_ty, out, i));
+
+    auto *next = builder.CreateAdd(i, llvm::ConstantInt::get(i64_ty, 1), "next", true, true);
+    i->addIncoming(next, loop_bb);
+    builder.CreateCondBr(builder.CreateICmpEQ(next, count, "done"), exit_bb, loop_bb);
+
+    builder.SetInsertPoint(exit_bb);
+    builder.CreateRetVoid();
+
+    if (kVerifyIr)
+        llvm::verifyFunction(*f, &llvm::errs());
+    return f;
+}
+
 // Create an alloca instruction in the entry block of the function.
 // This is used for mutable variables etc.
 llvm::AllocaInst *CreateEntryBlockAlloca(llvm::Function *the_function, const std::string &var_name) {
     llvm::IRBuilder<> tmp_b(&the_function->getEntryBlock(), the_function->getEntryBlock().begin());
-    return tmp_b.CreateAlloca(llvm::Type::getDoubleTy(kTheContext), 0, var_name.c_str());
+    return tmp_b.CreateAlloca(llvm::Type::getDoubleTy(kState->the_context), 0, var_name.c_str());
 }
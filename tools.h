@@ -5,15 +5,59 @@
 #include <llvm-9/llvm/IR/Value.h>
 #include <llvm-9/llvm/IR/Instructions.h>
 #include <llvm-9/llvm/IR/Function.h>
+#include <llvm-9/llvm/IR/GlobalVariable.h>
 #include <memory>
+#include <vector>
 
-std::unique_ptr<ExprAst> LogError(const char *str);
-std::unique_ptr<PrototypeAst> LogErrorP(const char *str);
-std::unique_ptr<StatAst> LogErrorS(const char *str);
-std::unique_ptr<CompoundStatAst> LogErrorCS(const char *str);
+NodeId LogError(const char *str);
 llvm::Value *LogErrorV(const char *str);
+
+// Debug builds run the IR verifier over every function generated and
+// before code generation, release builds leave it out.
+#ifdef NDEBUG
+const bool kVerifyIr = false;
+#else
+const bool kVerifyIr = true;
+#endif
+
 void InitializeModuleAndPassManager();
+// Register the host target for the JIT, once per process.
+void InitializeNativeTargetOnce();
+// Count one call or loop iteration for tiered compilation, see TieredJit.
+void EmitTierCount();
 llvm::Function *GetFunction(std::string name);
+// The global of kState->globals named name, declared in the module of
+// kState on first use.
+llvm::GlobalVariable *GetGlobal(std::string name);
+// Callees of at most this many instructions are inlined where they are
+// called, callees of at most kSpecializeThreshold get a clone for calls
+// with constant arguments.
+const unsigned kInlineThreshold = 24;
+const unsigned kSpecializeThreshold = 200;
+
+// If some of args are constants and callee is small and defined in this
+// module, return a clone of callee with the constants folded in and leave
+// only the other arguments in args. Otherwise return callee.
+llvm::Function *SpecializeCall(llvm::Function *callee, std::vector<llvm::Value *> &args);
+// Whether a call to callee should be marked alwaysinline.
+bool ShouldInline(llvm::Function *callee);
+// Inline the alwaysinline calls of f, so no pipeline has to run for it.
+void InlineSmallCalls(llvm::Function *f);
+
+// Whether every function and global module uses is defined in the JIT of
+// kState, in the host process or in defined_in, the JIT aborts on an
+// undefined symbol. Reports the ones that are not, e.g. a callee whose
+// definition had errors.
+bool AllSymbolsDefined(llvm::Module &module, llvm::Module *defined_in);
+// JIT the definitions and the pending top-level expressions of kState and
+// run the expressions in source order. The definitions stay in the JIT, the
+// expressions are removed again. False if an expression could not be run.
+bool RunTopLevelExprs(std::vector<double> &results);
+// Generate the batch entry point of scalar, for def f(double a, double b):
+//   void f_map(double *out, const double *a, const double *b, int64_t n)
+// computes out[i] = f(a[i], b[i]) for i < n. f is inlined into the loop, so
+// with -O2 and up the loop is vectorized. The arrays must not overlap.
+llvm::Function *CreateMapEntryPoint(llvm::Function *scalar);
 llvm::AllocaInst *CreateEntryBlockAlloca(llvm::Function *the_function, const std::string &var_name);
 
 #endif